@@ -0,0 +1,49 @@
+#include <cassert>
+
+#include "cached_clock.hpp"
+
+namespace
+{
+	thread_local cached_time current_time;
+	thread_local bool driven = false;
+}
+
+static void refresh(cached_time *time)
+{
+	int result = clock_gettime(CLOCK_REALTIME, &time->now);
+	assert(result == 0);
+
+	timespec monotonic;
+	result = clock_gettime(CLOCK_MONOTONIC, &monotonic);
+	assert(result == 0);
+	(void)result;
+	time->monotonic_ms = uint64_t(monotonic.tv_sec) * 1000u + monotonic.tv_nsec / 1000000L;
+
+	if (time->now.tv_sec != time->prefix_second || time->prefix[0] == '\0')
+	{
+		tm local;
+		localtime_r(&time->now.tv_sec, &local);
+		size_t written_bytes = strftime(time->prefix, sizeof time->prefix, "%H:%M:%S", &local);
+		assert(written_bytes > 0);
+		(void)written_bytes;
+		time->prefix_second = time->now.tv_sec;
+	}
+}
+
+void update_cached_clock()
+{
+	driven = true;
+	refresh(&current_time);
+}
+
+void release_cached_clock()
+{
+	driven = false;
+}
+
+const cached_time &cached_clock()
+{
+	if (!driven)
+		refresh(&current_time);
+	return current_time;
+}
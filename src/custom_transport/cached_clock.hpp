@@ -0,0 +1,29 @@
+#ifndef CACHED_CLOCK_HPP
+#define CACHED_CLOCK_HPP
+
+#include <cstdint>
+#include <ctime>
+
+/*
+ * Clock cached per thread (so per event loop). Loop refreshes it once per epoll_wait iteration and
+   everything what runs in handlers (logger, timeouts) just reads it - no clock_gettime per log line
+   and no localtime (which takes glibc lock and may stat TZ file) at all except once per second
+   for "HH:MM:SS" prefix.
+ * Time read in handler may be late by time spent in current batch.
+ * Thread which doesn't drive loop (or loop already finished) gets clock refreshed on every read.
+ */
+struct cached_time
+{
+	timespec now; // CLOCK_REALTIME
+	uint64_t monotonic_ms; // CLOCK_MONOTONIC, for timeouts
+	time_t prefix_second;
+	char prefix[16]; // "HH:MM:SS" of prefix_second
+};
+
+// refreshes clock of current thread, from now on it's updated only by next calls
+extern void update_cached_clock();
+// loop finished, cached_clock is refreshed on every call again
+extern void release_cached_clock();
+extern const cached_time &cached_clock();
+
+#endif // CACHED_CLOCK_HPP
@@ -1,11 +1,13 @@
 #include "custom_transport.hpp"
 #include "logger.hpp"
+#include "cached_clock.hpp"
 #include <cstdio>
 #include <cstring>
 #include <cassert>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <cstdlib>
@@ -13,18 +15,81 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <thread>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <algorithm>
 
 #include "memory_pool.hpp"
+#include "io_ring.hpp"
 
-t_accept_handler global_accept_handler = NULL;
-t_read_handler global_read_handler = NULL;
-t_write_handler global_write_handler = NULL;
+struct pending_send;
+struct posted_task;
 
-int server_fd = 0, epoll_fd = 0;
-epoll_event *events = NULL;
-memory_pool *pool = NULL;
-size_t connections = 0;
-volatile bool interrupted = false;
+/*
+ * Everything what was global before is kept per loop now. Loop is touched only by own thread
+   so there is no locking on hot path. The only shared state is accept handler (read-only after run),
+   wakeup_fd which is used only during shutdown and queue of posted tasks.
+ */
+struct event_loop
+{
+	int id;
+	int server_fd, epoll_fd;
+	epoll_event *events;
+	memory_pool *pool;
+	t_accept_handler accept_handler;
+	std::thread thread;
+	/*
+	 * Fixed-capacity connection slab. Slots below slots_used were handed out at least once
+	   and keep their buffer for next connection, released slot indexes are on free_slots stack.
+	 */
+	connection_data *slots;
+	uint32_t *free_slots;
+	uint32_t free_slots_number, slots_used;
+	// connections with pending work which is not visible for epoll anymore (edge was consumed)
+	connection_data *ready_head, *ready_tail;
+	// connections which used up budget of current round, they become ready list of next round
+	connection_data *deferred_head, *deferred_tail;
+	uint64_t round;
+	write_request *free_requests;
+	// single writer (loop thread), many readers (get_stats)
+	std::atomic<size_t> epoll_ctl_calls, messages, write_calls, read_calls;
+	std::atomic<size_t> bytes_read, bytes_written, read_eagains, write_eagains, read_pauses;
+	std::atomic<size_t> budget_exhausted, posted_tasks, post_wakeups;
+	std::atomic<size_t> reallocations, wakeups, events_number;
+	std::atomic<size_t> accepted, rejected, closed;
+	// periodic dump (transport_options::stats_interval_ms)
+	uint64_t next_dump_ms;
+	transport_stats last_dump;
+	// per connection deadlines and loop_timer-s, driven from run loop
+	timer_wheel timers;
+	// post/send from other threads: lock-free stack (newest first), post_fd is signalled when it was empty
+	std::atomic<posted_task*> posted;
+	int post_fd;
+	// io_uring backend
+	io_ring ring;
+	pending_send *free_sends;
+	// multishot accept is armed (io_uring); after EMFILE-like failure accepting (both backends)
+	// waits until some connection of this loop is closed
+	bool accepting, accept_paused;
+	size_t accept_paused_closed;
+};
+
+static t_accept_handler global_accept_handler = NULL;
+
+static event_loop *loops = NULL;
+static int loops_number = 0;
+static int wakeup_fd = -1;
+static transport_options options;
+static io_backend backend = io_backend::epoll;
+static thread_local event_loop *current_loop = NULL;
+static transport_stats last_run_stats = {};
+static std::atomic<bool> interrupted {false};
 
 static void check_errors(const char *message, int result)
 {
@@ -35,18 +100,18 @@ static void check_errors(const char *message, int result)
     }
 }
 
-static int make_socket_non_blocking (int sfd)
+// counters have single writer so there is no need for atomic read-modify-write
+static void add(std::atomic<size_t> &counter, size_t value)
 {
-    int flags = fcntl (sfd, F_GETFL, 0);
-	check_errors("fcntl", flags);
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
 
-    flags |= O_NONBLOCK;
-    int s = fcntl (sfd, F_SETFL, flags);
-    check_errors("fcntl", s);
-    return 0;
+static void increment(std::atomic<size_t> &counter)
+{
+	add(counter, 1);
 }
 
-static void reallocate_buffer_exp(buffer *data)
+static void reallocate_buffer_exp(memory_pool *pool, buffer *data)
 {
 	assert(data->size == data->capacity);
 	data->capacity = 2 * data->capacity;
@@ -54,11 +119,13 @@ static void reallocate_buffer_exp(buffer *data)
 //	data->bytes = (char *) realloc(data->bytes, data->capacity);
 	data->bytes = (char *) reallocate(pool, data->capacity, data->capacity/2, data->bytes);
 	assert(data->bytes != NULL);
-	logger_.log("Buffer reallocation. Capacity increased from %d B to %d B", data->size,
+	if (current_loop != NULL)
+		increment(current_loop->reallocations);
+	LOG_DEBUG("Buffer reallocation. Capacity increased from %d B to %d B", data->size,
 				data->capacity);
 }
 
-static int allocate_buffer(buffer *data)
+static int allocate_buffer(memory_pool *pool, buffer *data)
 {
 	data->capacity = STARTLEN;
 
@@ -69,36 +136,399 @@ static int allocate_buffer(buffer *data)
 	return 0;
 }
 
-static void free_buffer(buffer *)
+// buffer may come from other thread's pool (e.g. worker which produced response)
+static void free_buffer(buffer *data)
+{
+	deallocate(data->bytes, data->capacity);
+	data->bytes = NULL;
+	data->capacity = data->start = data->size = 0;
+}
+
+// buffers which grew for one big message give memory back to pool when they are recycled
+static void shrink_buffer(memory_pool *pool, buffer *data, size_t max_capacity)
+{
+	if (data->capacity <= max_capacity)
+		return;
+
+	free_buffer(data);
+	allocate_buffer(pool, data);
+}
+
+static void reserve_buffer(memory_pool *pool, buffer *data, size_t capacity)
+{
+	if (data->capacity >= capacity)
+		return;
+
+	size_t new_capacity = data->capacity;
+	while (new_capacity < capacity)
+		new_capacity *= 2;
+
+	data->bytes = (char *) reallocate(pool, new_capacity, data->capacity, data->bytes);
+	assert(data->bytes != NULL);
+	data->capacity = new_capacity;
+	if (current_loop != NULL)
+		increment(current_loop->reallocations);
+}
+
+static write_request *allocate_write_request(event_loop *loop)
+{
+	write_request *request = loop->free_requests;
+	if (request != NULL)
+		loop->free_requests = request->next;
+	else
+	{
+		request = (write_request *) allocate(loop->pool, sizeof(write_request));
+		allocate_buffer(loop->pool, &request->data);
+	}
+	request->next = NULL;
+	request->notify = true;
+	request->data.start = request->data.size = 0;
+	request->block = NULL;
+	return request;
+}
+
+static void free_write_request(event_loop *loop, write_request *request)
+{
+	if (request->block != NULL)
+	{
+		free(request->block);
+		return;
+	}
+	shrink_buffer(loop->pool, &request->data, MAXCACHEDLEN);
+	request->next = loop->free_requests;
+	loop->free_requests = request;
+}
+
+static void release_segments(event_loop *loop, segment_chain *chain)
+{
+	while (chain->head != NULL)
+	{
+		write_request *segment = chain->head;
+		chain->head = segment->next;
+		free_write_request(loop, segment);
+	}
+	chain->tail = NULL;
+	chain->size = 0;
+}
+
+static write_request *append_segment(event_loop *loop, segment_chain *chain)
+{
+	write_request *segment = allocate_write_request(loop);
+	reserve_buffer(loop->pool, &segment->data, SEGMENTLEN);
+	if (chain->tail != NULL)
+		chain->tail->next = segment;
+	else
+		chain->head = segment;
+	chain->tail = segment;
+	return segment;
+}
+
+static write_request *pop_write_request(connection_data *connection)
+{
+	write_request *request = connection->write_head;
+	connection->write_head = request->next;
+	if (connection->write_head == NULL)
+		connection->write_tail = NULL;
+	return request;
+}
+
+// epoll data for descriptors which are not connections
+constexpr static uint64_t listener_id = UINT64_MAX;
+constexpr static uint64_t wakeup_id = UINT64_MAX - 1;
+constexpr static uint64_t post_id = UINT64_MAX - 2;
+
+/*
+ * io_uring user_data: operation in the highest byte and connection_id without loop (ring belongs
+   to one loop anyway) or pointer to pending_send in the rest.
+ */
+enum uring_operation : uint64_t
+{
+	uring_accept = 1,
+	uring_wakeup,
+	uring_receive,
+	uring_send,
+	uring_cancel,
+	uring_post
+};
+
+constexpr static uint64_t operation_value_mask = (uint64_t(1) << 56) - 1;
+
+static uint64_t operation_data(uring_operation operation, uint64_t value)
+{
+	return (uint64_t(operation) << 56) | (value & operation_value_mask);
+}
+
+static connection_id make_connection_id(int loop_id, uint32_t generation, uint32_t index)
 {
+	return ((uint64_t)loop_id << 56) | ((uint64_t)(generation & 0xffffff) << 32) | index;
 }
 
-static connection_data *allocate_connection(int client_fd)
+static uint32_t slot_index(connection_id id)
 {
-    connection_data* connection = (connection_data*) callocate(pool, sizeof(connection_data));
+	return id & 0xffffffff;
+}
+
+static uint32_t generation(connection_id id)
+{
+	return (id >> 32) & 0xffffff;
+}
+
+static int loop_index(connection_id id)
+{
+	return id >> 56;
+}
+
+// NULL when slab is full
+static connection_data *allocate_connection(event_loop *loop, int client_fd)
+{
+	uint32_t index;
+	if (loop->free_slots_number > 0)
+		index = loop->free_slots[--loop->free_slots_number];
+	else
+		if (loop->slots_used < options.max_connections)
+		{
+			index = loop->slots_used++;
+			connection_data *connection = new (&loop->slots[index]) connection_data();
+			connection->id = make_connection_id(loop->id, 0, index);
+			allocate_buffer(loop->pool, &connection->data);
+		}
+		else
+			return NULL;
+
+	// slot may be still linked on ready list, so ready/next_ready are left as they are
+	connection_data *connection = &loop->slots[index];
 	connection->fd = client_fd;
-	allocate_buffer(&connection->data);
+	connection->event = 0;
+	connection->loop = loop;
+	connection->data.start = connection->data.size = 0;
+	connection->read_handler = nullptr;
+	connection->write_handler = nullptr;
+	connection->want_read = connection->want_write = false;
+	connection->readable = connection->writable = false;
+	connection->exhausted_round = 0;
+	connection->write_head = connection->write_tail = NULL;
+	connection->unreported_bytes = 0;
+	connection->bytes_read = connection->bytes_written = connection->messages = 0;
+	connection->idle_timeout = options.idle_timeout_ms;
+	connection->read_timeout = options.read_timeout_ms;
+	connection->write_timeout = options.write_timeout_ms;
+	connection->last_activity = cached_clock().monotonic_ms;
+	connection->read_deadline = connection->write_deadline = 0;
+	connection->prepared = NULL;
+	connection->prepared_queued = false;
+	connection->segmented = false;
+	connection->segments = segment_chain {NULL, NULL, 0};
+	connection->inbound = segment_chain {NULL, NULL, 0};
+	connection->peer_closed = false;
+	connection->read_high_watermark = options.read_high_watermark;
+	connection->read_low_watermark = options.read_low_watermark;
+	connection->receiving = connection->receive_paused = false;
+	connection->framing = frame_prefix::none;
+	connection->frame_handler = nullptr;
+	connection->close_when_written = false;
 	return connection;
 }
 
+/*
+ * Multishot receive keeps socket alive even after close, so it's cancelled (cancel goes with next
+   io_uring_enter - free_connection submits it at once, its successful completion is skipped).
+   Receive itself completes with -ECANCELED.
+ */
+static void cancel_receive(connection_data *connection)
+{
+	io_uring_sqe *sqe = get_sqe(&connection->loop->ring, IORING_OP_ASYNC_CANCEL, -1,
+								operation_data(uring_cancel, 0));
+	sqe->addr = operation_data(uring_receive, connection->id);
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+}
+
+static void arm_receive(connection_data *connection)
+{
+    io_uring_sqe *sqe = get_sqe(&connection->loop->ring, IORING_OP_RECV, connection->fd,
+                                operation_data(uring_receive, connection->id));
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    connection->receiving = true;
+}
+
+/*
+ * Multishot receive doesn't wait for async_read, so bytes nobody asked for pile up in inbound chain.
+   At high watermark receive is cancelled (completions already on the way are still stored)
+   and socket buffer fills up instead.
+ */
+static void pause_receive(connection_data *connection)
+{
+    connection->receive_paused = true;
+    increment(connection->loop->read_pauses);
+    if (connection->receiving)
+        cancel_receive(connection);
+}
+
+// cancelled receive is armed again by its last completion if that didn't come yet
+static void resume_receive(connection_data *connection)
+{
+    connection->receive_paused = false;
+    if (!connection->receiving && !connection->peer_closed)
+        arm_receive(connection);
+}
+
+static void check_read_watermarks(connection_data *connection)
+{
+    const size_t inbound = connection->inbound.size;
+    if (!connection->receive_paused && inbound >= connection->read_high_watermark)
+        pause_receive(connection);
+    else
+    if (connection->receive_paused && inbound <= connection->read_low_watermark)
+        resume_receive(connection);
+}
+
+/*
+ * closing descriptor removes it from epoll set, fd = -1 marks connection as dead for pending events
+   (and completions - sendmsg in flight gives its requests back to loop when it completes)
+ * io_uring: queued SQEs (sends, receive armed in this batch) name socket only by descriptor number,
+   kernel takes socket itself when it gets them. They are submitted before close, otherwise
+   accept could reuse the number and they would go to another peer.
+ */
 static void free_connection(connection_data *connection)
 {
+	event_loop *loop = connection->loop;
+	if (backend == io_backend::io_uring)
+	{
+		if (connection->receiving)
+			cancel_receive(connection);
+		submit_queued(&loop->ring);
+	}
 	close(connection->fd);
-	free_buffer(&connection->data);
+	connection->fd = -1;
+	increment(loop->closed);
+	unschedule_timer(&loop->timers, &connection->timer);
+	connection->want_read = connection->want_write = false;
+	if (connection->prepared != NULL && !connection->prepared_queued)
+		free_write_request(loop, connection->prepared);
+	connection->prepared = NULL;
+	while (connection->write_head != NULL)
+		free_write_request(loop, pop_write_request(connection));
+	release_segments(loop, &connection->segments);
+	release_segments(loop, &connection->inbound);
+	// buffer stays with slot and is reused by next connection
+	shrink_buffer(loop->pool, &connection->data, STARTLEN);
+
+	const uint32_t index = slot_index(connection->id);
+	connection->id = make_connection_id(loop->id, generation(connection->id) + 1, index);
+	loop->free_slots[loop->free_slots_number++] = index;
+}
+
+connection_data *find_connection(connection_id id)
+{
+	const int loop = loop_index(id);
+	if (loops == NULL || loop >= loops_number)
+		return NULL;
+
+	const uint32_t index = slot_index(id);
+	if (index >= loops[loop].slots_used)
+		return NULL;
+
+	connection_data *connection = &loops[loop].slots[index];
+	return (connection->id == id && connection->fd >= 0)? connection : NULL;
 }
 
-static void modify_epoll_context(int epoll_fd, int operation, int client_fd,
-								 uint32_t events, void *data)
+static void modify_epoll_context(event_loop *loop, int operation, int client_fd,
+								 uint32_t events, uint64_t data)
 {
     epoll_event event;
     event.events = events | EPOLLET;
-    event.data.ptr = data;
+    event.data.u64 = data;
 
-    int return_code = epoll_ctl(epoll_fd, operation, client_fd, &event);
+    int return_code = epoll_ctl(loop->epoll_fd, operation, client_fd, &event);
 	check_errors("epoll_ctl", return_code);
+	increment(loop->epoll_ctl_calls);
+}
+
+static void schedule(connection_data *connection)
+{
+	if (connection->ready)
+		return;
+
+	event_loop *loop = connection->loop;
+	connection->ready = true;
+	connection->next_ready = NULL;
+	if (loop->ready_tail != NULL)
+		loop->ready_tail->next_ready = connection;
+	else
+		loop->ready_head = connection;
+	loop->ready_tail = connection;
+}
+
+// connection has more to do but got its share of current round, it's visited again in next one
+static void exhaust_budget(connection_data *connection)
+{
+	connection->exhausted_round = connection->loop->round;
+	increment(connection->loop->budget_exhausted);
+}
+
+// bytes which one read may deliver
+static size_t read_limit(const connection_data *connection)
+{
+	return std::min(connection->read_high_watermark, options.round_budget_bytes);
+}
+
+static uint64_t earliest_deadline(const connection_data *connection)
+{
+	const uint64_t deadlines[] = {
+		connection->idle_timeout? connection->last_activity + connection->idle_timeout : 0,
+		connection->read_deadline,
+		connection->write_deadline
+	};
+	uint64_t earliest = 0;
+	for (uint64_t deadline : deadlines)
+		if (deadline != 0 && (earliest == 0 || deadline < earliest))
+			earliest = deadline;
+	return earliest;
+}
+
+// timer is moved only when deadline comes earlier, later deadline is noticed when timer fires
+static void arm_deadline(connection_data *connection, uint64_t deadline)
+{
+	timer_node *timer = &connection->timer;
+	if (deadline != 0 && (!timer_armed(timer) || deadline < timer->expires))
+		schedule_timer(&connection->loop->timers, timer, deadline);
+}
+
+// bytes were read or written - idle deadline moves later, so it's only a store
+static void touch(connection_data *connection)
+{
+	connection->last_activity = cached_clock().monotonic_ms;
+}
+
+// caller starts waiting for bytes
+static void start_read_deadline(connection_data *connection)
+{
+	if (connection->read_timeout == 0)
+		return;
+	connection->read_deadline = cached_clock().monotonic_ms + connection->read_timeout;
+	arm_deadline(connection, connection->read_deadline);
+}
+
+static void enqueue_write_request(connection_data *connection, write_request *request)
+{
+	if (connection->write_tail != NULL)
+		connection->write_tail->next = request;
+	else
+		connection->write_head = request;
+	connection->write_tail = request;
+
+	if (connection->write_timeout != 0 && connection->write_deadline == 0)
+	{
+		connection->write_deadline = cached_clock().monotonic_ms + connection->write_timeout;
+		arm_deadline(connection, connection->write_deadline);
+	}
+	connection->want_write = true;
+	if (connection->writable)
+		schedule(connection);
 }
 
-static int resolve_name_and_bind (int port)
+static int resolve_name_and_bind (int port, bool reuse_port)
 {
     sockaddr_in server_addr;
     const int opt = 1;
@@ -109,6 +539,12 @@ static int resolve_name_and_bind (int port)
     int return_code = setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int));
     check_errors("socket", return_code);
 
+    if (reuse_port)
+    {
+        return_code = setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(int));
+        check_errors("socket", return_code);
+    }
+
     bzero(&server_addr, sizeof(server_addr));
 
 	server_addr.sin_family = AF_INET; // IPv4 only
@@ -121,292 +557,1467 @@ static int resolve_name_and_bind (int port)
     return server_fd;
 }
 
-static void handle_reading_data_from_event(connection_data *connection)
+// free space for next read: end of data (which grows) or last segment (new one when full)
+static buffer *reading_space(connection_data *connection)
 {
-	buffer *data = &connection->data;
-	data->size = 0;
-
-	while (true)
+	event_loop *loop = connection->loop;
+	if (!connection->segmented)
 	{
+		buffer *data = &connection->data;
 		if (data->size == data->capacity)
-			reallocate_buffer_exp(data);
-
-		int n = read(connection->fd, data->bytes + data->size,
-					 data->capacity - data->size);
-
-		if (n == -1)
-		{
-			assert(errno == EAGAIN);
-			break;
-		}
-		else
-		if(n == 0)
-		{
+			reallocate_buffer_exp(loop->pool, data);
+		return data;
+	}
 
-            logger_.log("Error during reading. Connection was closed on %d", connection->fd);
-			free_connection(connection);
+	segment_chain *chain = &connection->segments;
+	if (chain->tail == NULL || chain->tail->data.size == chain->tail->data.capacity)
+		append_segment(loop, chain);
+	return &chain->tail->data;
+}
 
-			if (global_read_handler != NULL)
-				global_read_handler(n, NULL);
-			return;
-		}
-		else
-		{
-			assert(n > 0);
-			data->size += n;
-		}
-	}
+static void close_framed_connection(connection_data *connection)
+{
+	t_frame_handler frame_handler = connection->frame_handler;
+	free_connection(connection);
 
-	if (global_read_handler != NULL)
-		global_read_handler(data->size, connection);
+	if (frame_handler != NULL)
+		frame_handler(NULL, 0, NULL);
 }
 
-static bool handle_writing_data_to_event(connection_data *connection)
+/*
+ * Delivers every complete frame from data[start, size) and moves partial frame (if any)
+   to the beginning of buffer. When prefix of partial frame is known buffer is grown at once
+   for whole frame.
+ */
+static void deliver_frames(connection_data *connection)
 {
+	event_loop *loop = connection->loop;
 	buffer *data = &connection->data;
-	assert(data->start <= data->capacity);
 
-	while (true)
+	while (connection->fd >= 0 && connection->framing != frame_prefix::none)
 	{
-		int n = write(connection->fd, data->bytes + data->start, data->size - data->start);
-		//logger_.log("%d B was written", n); // <--- this is the greatest WTF I have ever seen :(
+		size_t frame_size = 0;
+		const int prefix_size = decode_frame_prefix(connection->framing, data->bytes + data->start,
+													data->size - data->start, &frame_size);
+		if (prefix_size < 0 || frame_size > connection->max_frame_size)
+		{
+			LOG_WARN("Frame is malformed or too big (%zu B). Connection was closed on %d",
+						frame_size, connection->fd);
+			close_framed_connection(connection);
+			return;
+		}
 
-		assert( !((n == -1 && errno == EINTR)) );
+		if (prefix_size == 0)
+			break;
 
-		if (n != -1)
+		const size_t frame_end = data->start + prefix_size + frame_size;
+		if (frame_end > data->size)
 		{
-			assert(n > 0 && (n <= (int)data->size) );
-			data->start += n;
-			if (data->start == data->size)
-				break;
+			reserve_buffer(loop->pool, data, frame_end);
+			break;
 		}
-		else
-			if (n == -1)
-			{
-				// TO DO:
-				// EAGAIN means that we cannot send more data now (because of e.g full recv buffer on client side)
-				// but there are some data to send. So we should break loop but before that
-				// remember state and modify epoll context for writing like:
-				// modify_epoll_context(epoll_fd, EPOLL_CTL_ADD, connection->fd, EPOLLOUT, connection);
-
-				// Now we have spin loop here but we just want to sleep in epoll_wait.
-				if (errno == EAGAIN)
-				{
-					// we leave data->start as it is
-					return false;
-				}
-
-				logger_.log("Error during writing. Connection was closed on %d", connection->fd);
-				free_connection(connection);
-
-				if (global_write_handler != NULL)
-					global_write_handler(n, NULL);
-
-				data->start = 0;
-				return true;
-			}
+
+		const char *frame = data->bytes + data->start + prefix_size;
+		data->start = frame_end;
+		increment(loop->messages);
+		connection->messages++;
+
+		t_frame_handler frame_handler = connection->frame_handler;
+		if (frame_handler != NULL)
+			frame_handler(frame, frame_size, connection);
 	}
 
-	if (data->start != data->size)
+	if (connection->fd >= 0 && data->start > 0)
 	{
-		logger_.log("start = %zu, data->size = %zu!", data->start, data->size);
-		assert(false);
+		memmove(data->bytes, data->bytes + data->start, data->size - data->start);
+		data->size -= data->start;
+		data->start = 0;
 	}
-
-
-	if (global_write_handler != NULL)
-		global_write_handler(data->size, connection);
-
-	data->start = 0;
-	return true;
 }
 
-static void handle_closing(connection_data *connection)
+// peer closed connection, read failed or deadline was missed
+static void handle_read_failure(connection_data *connection, const char *reason)
 {
-	logger_.log("Client associated with socket %d is gone...", connection->fd);
+	LOG_WARN("%s. Connection was closed on %d", reason, connection->fd);
+	if (connection->framing != frame_prefix::none)
+	{
+		// frames which are complete are still delivered
+		deliver_frames(connection);
+		if (connection->fd >= 0)
+			close_framed_connection(connection);
+		return;
+	}
+
+	t_read_handler read_handler = connection->read_handler;
 	free_connection(connection);
+
+	if (read_handler != NULL)
+		read_handler(0, NULL);
 }
 
-static void handle_server_closing(int server_fd)
+// io_uring: requests of sendmsg in flight are out of queue, connection is not writable until it completes
+static bool outbound_written(connection_data *connection)
 {
-	logger_.log("Server associated with socket %d is gone...", server_fd);
-    close (server_fd);
+	return connection->write_head == NULL && (backend == io_backend::epoll || connection->writable);
 }
 
-static void handle_accepting_connection(int server_fd)
+/*
+ * Peer of framed connection ended its stream (it may still read). Frames received before end of
+   stream are delivered and responses queued for them are written before connection is closed.
+ */
+static void handle_framed_end_of_stream(connection_data *connection)
 {
-    sockaddr_in clientaddr;
-    socklen_t clientlen = sizeof(clientaddr);
-
-    int client_fd = accept(server_fd, (sockaddr*)&clientaddr, &clientlen);
-    check_errors("accept", client_fd);
+	LOG_DEBUG("Peer ended stream on socket %d", connection->fd);
+	deliver_frames(connection);
+	if (connection->fd < 0)
+		return;
 
-    char client_address[NI_MAXHOST], client_port[NI_MAXSERV];
-    int error_code = getnameinfo ((sockaddr*)&clientaddr, clientlen,
-                                  client_address, sizeof client_address,
-                                  client_port, sizeof client_port,
-                                  NI_NUMERICHOST | NI_NUMERICSERV);
+	if (outbound_written(connection))
+	{
+		close_framed_connection(connection);
+		return;
+	}
+	connection->want_read = connection->readable = false;
+	connection->close_when_written = true;
+}
 
-    make_socket_non_blocking(client_fd);
-	connection_data *connection = allocate_connection(client_fd);
+// received bytes are already where caller expects them (data, segments or framing buffer)
+static void complete_read(connection_data *connection, size_t received)
+{
+	connection->read_deadline = 0;
+	if (connection->framing != frame_prefix::none)
+	{
+		connection->want_read = true;
+		start_read_deadline(connection);
+		deliver_frames(connection);
+		// batch was cut by high watermark, rest is read in next round without waiting for edge
+		if (connection->fd >= 0 && connection->want_read && connection->readable)
+			schedule(connection);
+		return;
+	}
 
-	connections++;
+	connection->segments.size = connection->segmented? received : 0;
 
-    if (global_accept_handler != NULL)
-		global_accept_handler(error_code, connection, client_address, client_port);
+	increment(connection->loop->messages);
+	connection->messages++;
+	// local copy - handler may install new one on connection during call
+	t_read_handler read_handler = connection->read_handler;
+	if (read_handler != NULL)
+		read_handler(received, connection);
 }
 
-static void new_handle_accepting_connection(int server_fd, struct epoll_event &client_event,
-                                            struct epoll_event &server_event)
+static void handle_reading_data_from_event(connection_data *connection)
 {
-    sockaddr_in clientaddr;
-    socklen_t clientlen = sizeof(clientaddr);
-
-    int client_fd = accept(server_fd, (sockaddr*)&clientaddr, &clientlen);
-    assert(client_fd > 0 || (client_fd == -1 && errno == EAGAIN));
-
-    if (client_fd > 0)
-    {
-        char client_address[NI_MAXHOST], client_port[NI_MAXSERV];
-        int error_code = getnameinfo ((sockaddr*)&clientaddr, clientlen,
-                                      client_address, sizeof client_address,
-                                      client_port, sizeof client_port,
-                                      NI_NUMERICHOST | NI_NUMERICSERV);
+	event_loop *loop = connection->loop;
+	const bool framed = connection->framing != frame_prefix::none;
+	size_t received = 0;
+	if (!framed)
+		connection->data.size = 0;
+	release_segments(loop, &connection->segments);
+
+	// batch ends at high watermark or round budget even if there is more, connection stays readable then
+	const size_t limit = read_limit(connection);
+	int calls = 0;
+	while (received < limit && calls < options.round_budget_calls)
+	{
+		buffer *data = reading_space(connection);
+		const size_t space = std::min(data->capacity - data->size, limit - received);
 
-        make_socket_non_blocking(client_fd);
-        connection_data *connection = allocate_connection(client_fd);
+		int n = read(connection->fd, data->bytes + data->size, space);
+		increment(loop->read_calls);
+		calls++;
 
-        connections++;
+		if (n == -1 && errno == EAGAIN)
+		{
+			increment(loop->read_eagains);
+			connection->readable = false;
+			break;
+		}
+		else
+		if (n == 0 && framed)
+		{
+			handle_framed_end_of_stream(connection);
+			return;
+		}
+		else
+		if(n <= 0)
+		{
+			handle_read_failure(connection, "Error during reading");
+			return;
+		}
+		else
+		{
+			data->size += n;
+			received += n;
+			add(loop->bytes_read, n);
+			connection->bytes_read += n;
+			touch(connection);
+		}
+	}
 
-//        epoll_event event;
-//        event.events = EPOLLIN | EPOLLET;
-//        event.data.ptr = connection;
+	if (connection->readable)
+	{
+		if (received >= connection->read_high_watermark)
+			increment(loop->read_pauses);
+		exhaust_budget(connection);
+	}
+	else
+	if (received == 0)
+	{
+		// previous batch was cut exactly at the end of data, caller keeps waiting for next edge
+		connection->want_read = true;
+		return;
+	}
+	complete_read(connection, received);
+}
 
-//        int return_code = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
-//        assert(return_code >= 0);
+// iovec array for up to MAXIOV queued requests starting from head, last one may be cut to max_bytes in total
+static int gather_write_requests(write_request *head, iovec *parts, size_t max_bytes)
+{
+	int count = 0;
+	for (write_request *request = head; request != NULL && count < MAXIOV && max_bytes > 0;
+		 request = request->next)
+	{
+		assert(request->data.start < request->data.size);
+		parts[count].iov_base = request->data.bytes + request->data.start;
+		parts[count].iov_len = std::min(request->data.size - request->data.start, max_bytes);
+		max_bytes -= parts[count].iov_len;
+		count++;
+	}
+	return count;
+}
 
-        int return_code = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, server_fd, &server_event);
-        assert(return_code >= 0);
+static void handle_write_failure(connection_data *connection, int result, const char *reason)
+{
+	LOG_WARN("%s. Connection was closed on %d", reason, connection->fd);
+	t_write_handler write_handler = connection->write_handler;
+	free_connection(connection);
 
-        if (global_accept_handler != NULL)
-            global_accept_handler(error_code, connection, client_address, client_port);
-    }
+	if (write_handler != NULL)
+		write_handler(result, NULL);
 }
 
-static void interrupt_handler(int , siginfo_t *, void *)
+/*
+ * n bytes from head of outbound queue were written. Partially written request keeps its
+   progress in data.start. Returns false when connection was closed by write handler (or after
+   last response when peer ended stream, see close_when_written).
+ */
+static bool complete_write(connection_data *connection, size_t n)
 {
-	interrupted = true;
+	add(connection->loop->bytes_written, n);
+	connection->bytes_written += n;
+	touch(connection);
+	if (connection->write_deadline != 0)
+		connection->write_deadline = connection->last_activity + connection->write_timeout;
+	size_t remaining = n;
+	while (remaining > 0)
+	{
+		buffer *data = &connection->write_head->data;
+		const size_t left = data->size - data->start;
+		if (remaining < left)
+		{
+			data->start += remaining;
+			break;
+		}
+		remaining -= left;
+
+		write_request *request = pop_write_request(connection);
+		const bool notify = request->notify;
+		connection->unreported_bytes += request->data.size;
+		free_write_request(connection->loop, request);
+		if (connection->write_head == NULL)
+			connection->want_write = false;
+		if (!notify)
+			continue;
+
+		const size_t written = connection->unreported_bytes;
+		connection->unreported_bytes = 0;
+		t_write_handler write_handler = connection->write_handler;
+		if (write_handler != NULL)
+			write_handler(written, connection);
+		if (connection->fd < 0)
+			return false;
+	}
+	if (!connection->want_write)
+		connection->write_deadline = 0;
+	if (connection->close_when_written && outbound_written(connection))
+	{
+		close_framed_connection(connection);
+		return false;
+	}
+	return true;
 }
 
-void init(int port)
+/*
+ * Flushes outbound queue in order. Up to MAXIOV queued requests are gathered into one iovec array
+   and sent by single sendmsg call, so pipelined small responses (or header + body queued
+   separately) cost one syscall.
+ * Write handler is called once per completely written request queued with notification
+   (async_write); requests queued by queue_write are silent.
+ * Returns false when kernel buffer is full (EAGAIN) - remaining data stays in queue and connection
+   sleeps in epoll_wait until EPOLLOUT edge (it's registered for it all the time). Also when round
+   budget was used up - then connection waits on ready list for next round.
+ * MSG_NOSIGNAL - peer which closed connection gives EPIPE instead of killing us by SIGPIPE.
+ */
+static bool handle_writing_data_to_event(connection_data *connection)
 {
-    pool = ( memory_pool *) malloc(sizeof(memory_pool));
-    init_pool(pool);
-    logger_.log("Memory pool is ready");
+	iovec parts[MAXIOV];
+	size_t written = 0;
+	int calls = 0;
 
-    server_fd = resolve_name_and_bind(port);
+	while (connection->write_head != NULL)
+	{
+		if (written >= options.round_budget_bytes || calls == options.round_budget_calls)
+		{
+			// still writable, rest goes in next round
+			exhaust_budget(connection);
+			schedule(connection);
+			return false;
+		}
 
-    int return_code = listen (server_fd, MAXCONN);
-    check_errors("listen", return_code);
+		msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = parts;
+		message.msg_iovlen = gather_write_requests(connection->write_head, parts,
+												   options.round_budget_bytes - written);
 
-	epoll_fd = epoll_create (1);
-    check_errors("epoll_create", epoll_fd);
+		ssize_t n = sendmsg(connection->fd, &message, MSG_NOSIGNAL);
+		increment(connection->loop->write_calls);
+		calls++;
+		//logger_.log("%d B was written", n); // <--- this is the greatest WTF I have ever seen :(
 
-    modify_epoll_context(epoll_fd, EPOLL_CTL_ADD, server_fd, EPOLLIN, &server_fd);
-    modify_epoll_context(epoll_fd, EPOLL_CTL_MOD, server_fd, EPOLLIN, &server_fd);
-    events = (epoll_event *)calloc(MAXEVENTS, sizeof(epoll_event));
+		assert( !((n == -1 && errno == EINTR)) );
 
-	struct sigaction action;
-	memset(&action, 0, sizeof(action));
-	sigemptyset(&action.sa_mask);
-	action.sa_sigaction = &interrupt_handler;
-	action.sa_flags = SA_SIGINFO;
+		if (n == -1)
+		{
+			if (errno == EAGAIN)
+			{
+				// we leave data->start as it is
+				increment(connection->loop->write_eagains);
+				connection->writable = false;
+				return false;
+			}
 
-	return_code = sigaction(SIGINT, &action, NULL);
-	check_errors("sigaction SIGINT", return_code);
+			handle_write_failure(connection, n, "Error during writing");
+			return true;
+		}
 
-	return_code = sigaction(SIGTERM, &action, NULL);
-	check_errors("sigaction SIGTERM", return_code);
+		assert(n > 0);
+		written += n;
+		if (!complete_write(connection, n))
+			return true;
+	}
 
-    logger_.log("Event loop is ready. Waiting for connections on port = %d...", port);
+	connection->want_write = false;
+	return true;
 }
 
-void run()
+// whole segments from head of inbound chain up to read_limit (at least one) become segments of read
+static size_t take_inbound_segments(connection_data *connection)
 {
-    int client_fd;
-    struct epoll_event client_event =
-    {
-        .events = EPOLLIN | EPOLLET,
-        .data = {.ptr = &client_fd}
-    };
-    struct epoll_event server_event =
-    {
-        .events = EPOLLIN | EPOLLET,
-        .data = {.ptr = &server_fd}
-    };
+	segment_chain *inbound = &connection->inbound;
+	segment_chain *segments = &connection->segments;
+	while (inbound->head != NULL)
+	{
+		write_request *segment = inbound->head;
+		if (segments->head != NULL && segments->size + segment->data.size > read_limit(connection))
+			break;
+		inbound->head = segment->next;
+		inbound->size -= segment->data.size;
+		segment->next = NULL;
+		if (segments->tail != NULL)
+			segments->tail->next = segment;
+		else
+			segments->head = segment;
+		segments->tail = segment;
+		segments->size += segment->data.size;
+	}
+	if (inbound->head == NULL)
+		inbound->tail = NULL;
+	return segments->size;
+}
+
+// copies up to read_limit from head of inbound chain to data, rest of partially copied segment is moved to its front
+static size_t copy_inbound(connection_data *connection)
+{
+	event_loop *loop = connection->loop;
+	segment_chain *inbound = &connection->inbound;
+	buffer *data = &connection->data;
+	const size_t received = std::min(inbound->size, read_limit(connection));
+	reserve_buffer(loop->pool, data, data->size + received);
+
+	size_t left = received;
+	while (left > 0)
+	{
+		write_request *segment = inbound->head;
+		const size_t part = std::min(left, segment->data.size);
+		memcpy(data->bytes + data->size, segment->data.bytes, part);
+		data->size += part;
+		inbound->size -= part;
+		left -= part;
+		if (part < segment->data.size)
+		{
+			memmove(segment->data.bytes, segment->data.bytes + part, segment->data.size - part);
+			segment->data.size -= part;
+			break;
+		}
+		inbound->head = segment->next;
+		if (inbound->head == NULL)
+			inbound->tail = NULL;
+		free_write_request(loop, segment);
+	}
+	return received;
+}
+
+/*
+ * io_uring counterpart of handle_reading_data_from_event. Bytes were received already (in framing
+   mode straight to data, otherwise to inbound chain) so they are only handed over: segmented
+   reads take segments of inbound chain as they are, raw reads get them copied to data - both
+   up to high watermark (and round budget), the rest waits for next read. End of stream is reported after everything
+   received before it.
+ */
+static void deliver_received(connection_data *connection)
+{
+	event_loop *loop = connection->loop;
+	const bool framed = connection->framing != frame_prefix::none;
+
+	if (!framed && connection->inbound.size == 0)
+	{
+		connection->readable = false;
+		handle_read_failure(connection, "Error during reading");
+		return;
+	}
+
+	release_segments(loop, &connection->segments);
+	size_t received = 0;
+	if (framed)
+	{
+		// bytes received before async_read_frames switched framing on wait in inbound chain
+		if (connection->inbound.size > 0)
+			copy_inbound(connection);
+		connection->readable = connection->inbound.size > 0 || connection->peer_closed;
+		check_read_watermarks(connection);
+	}
+	else
+	{
+		if (connection->segmented)
+			received = take_inbound_segments(connection);
+		else
+		{
+			connection->data.size = 0;
+			received = copy_inbound(connection);
+		}
+		connection->readable = connection->inbound.size > 0 || connection->peer_closed;
+		if (connection->inbound.size > 0)
+			exhaust_budget(connection);
+		check_read_watermarks(connection);
+	}
+
+	if (framed && connection->peer_closed && connection->inbound.size == 0)
+	{
+		handle_framed_end_of_stream(connection);
+		return;
+	}
+	complete_read(connection, received);
+}
+
+/*
+ * sendmsg in flight. Kernel reads message and parts until completion so they can't live on stack,
+   requests being sent are taken out of queue (so queue_write never appends to buffer which
+   kernel reads) and closed connection leaves them here until completion comes.
+ */
+struct pending_send
+{
+	pending_send *next;
+	connection_id connection;
+	write_request *head, *tail;
+	msghdr message;
+	iovec parts[MAXIOV];
+};
+
+// io_uring counterpart of handle_writing_data_to_event, writable is false until completion
+static void submit_send(connection_data *connection)
+{
+	event_loop *loop = connection->loop;
+	if (connection->write_head == NULL)
+	{
+		connection->want_write = false;
+		return;
+	}
+
+	pending_send *pending = loop->free_sends;
+	if (pending != NULL)
+		loop->free_sends = pending->next;
+	else
+		pending = (pending_send *) allocate(loop->pool, sizeof(pending_send));
+	pending->connection = connection->id;
+
+	const int count = gather_write_requests(connection->write_head, pending->parts, options.round_budget_bytes);
+	pending->head = pending->tail = connection->write_head;
+	for (int i = 1; i < count; i++)
+		pending->tail = pending->tail->next;
+	connection->write_head = pending->tail->next;
+	if (connection->write_head == NULL)
+		connection->write_tail = NULL;
+	pending->tail->next = NULL;
+
+	memset(&pending->message, 0, sizeof(pending->message));
+	pending->message.msg_iov = pending->parts;
+	pending->message.msg_iovlen = count;
+
+	io_uring_sqe *sqe = get_sqe(&loop->ring, IORING_OP_SENDMSG, connection->fd,
+								operation_data(uring_send, (uint64_t) pending));
+	sqe->addr = (uint64_t) &pending->message;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	connection->writable = false;
+	increment(loop->write_calls);
+}
+
+static void handle_closing(connection_data *connection)
+{
+	LOG_DEBUG("Client associated with socket %d is gone...", connection->fd);
+	free_connection(connection);
+}
+
+static void process_connection(connection_data *connection)
+{
+	const bool uring = backend == io_backend::io_uring;
+	if (connection->want_read && connection->readable)
+	{
+		connection->want_read = false;
+		if (uring)
+			deliver_received(connection);
+		else
+			handle_reading_data_from_event(connection);
+	}
+
+	if (connection->fd >= 0 && connection->want_write && connection->writable)
+	{
+		if (uring)
+			submit_send(connection);
+		else
+			handle_writing_data_to_event(connection);
+	}
+}
+
+// connection stays marked as ready while it waits for next round
+static void defer_connection(event_loop *loop, connection_data *connection)
+{
+	connection->next_ready = NULL;
+	if (loop->deferred_tail != NULL)
+		loop->deferred_tail->next_ready = connection;
+	else
+		loop->deferred_head = connection;
+	loop->deferred_tail = connection;
+}
+
+/*
+ * Connections which used up round budget are not processed again (even if handler scheduled them),
+   they start ready list of next round - after all events which come meanwhile.
+ */
+static void process_ready_connections(event_loop *loop)
+{
+	while (loop->ready_head != NULL)
+	{
+		connection_data *connection = loop->ready_head;
+		loop->ready_head = connection->next_ready;
+		if (loop->ready_head == NULL)
+			loop->ready_tail = NULL;
+
+		if (connection->fd >= 0 && connection->exhausted_round == loop->round)
+		{
+			defer_connection(loop, connection);
+			continue;
+		}
+		connection->ready = false;
+		if (connection->fd >= 0)
+			process_connection(connection);
+	}
+
+	loop->ready_head = loop->deferred_head;
+	loop->ready_tail = loop->deferred_tail;
+	loop->deferred_head = loop->deferred_tail = NULL;
+}
+
+static void handle_server_closing(int server_fd)
+{
+	LOG_INFO("Server associated with socket %d is gone...", server_fd);
+    // multishot accept keeps listener alive until ring is torn down (asynchronously), port is freed now
+    shutdown(server_fd, SHUT_RDWR);
+    close (server_fd);
+}
+
+// deadlines are only stored when refreshed, so timer which fires early is just moved to the earliest one
+static void connection_timer_expired(timer_node *timer)
+{
+    connection_data *connection = (connection_data *) timer->owner;
+    const uint64_t now = cached_clock().monotonic_ms;
+    const uint64_t deadline = earliest_deadline(connection);
+    if (deadline == 0)
+        return;
+    if (deadline > now)
+    {
+        schedule_timer(&connection->loop->timers, timer, deadline);
+        return;
+    }
+
+    if (connection->write_deadline != 0 && connection->write_deadline <= now)
+        handle_write_failure(connection, -1, "Write timeout");
+    else
+        handle_read_failure(connection, (connection->read_deadline != 0 && connection->read_deadline <= now)?
+                                "Read timeout" : "Idle timeout");
+}
+
+// peer address is not known (peer_length = 0) when accepted by io_uring
+static void accept_connection(event_loop *loop, int client_fd, const sockaddr_storage *client_address,
+                              socklen_t client_length)
+{
+    connection_data *connection = allocate_connection(loop, client_fd);
+    if (connection == NULL)
+    {
+        LOG_WARN("Too many connections (%u). Client on socket %d is rejected",
+                    options.max_connections, client_fd);
+        close(client_fd);
+        increment(loop->rejected);
+        if (loop->accept_handler != NULL)
+            loop->accept_handler(EMFILE, NULL);
+        return;
+    }
+
+    if (client_length > 0)
+        memcpy(&connection->peer, client_address, client_length);
+    connection->peer_length = client_length;
+    connection->timer.expire = connection_timer_expired;
+    connection->timer.owner = connection;
+    if (connection->idle_timeout != 0)
+        arm_deadline(connection, connection->last_activity + connection->idle_timeout);
+    if (backend == io_backend::io_uring)
+    {
+        connection->writable = true;
+        arm_receive(connection);
+    }
+    else
+        modify_epoll_context(loop, EPOLL_CTL_ADD, client_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP,
+                             connection->id);
+
+    increment(loop->accepted);
+
+    if (loop->accept_handler != NULL)
+        loop->accept_handler(0, connection);
+}
+
+/*
+ * Drains whole listen backlog in one wakeup (edge-triggered listener). accept4 gives non-blocking
+   socket directly so there is no fcntl, peer address is kept raw on connection and formatted only
+   if accept handler asks for it (peer_address).
+ */
+static void handle_accepting_connections(event_loop *loop)
+{
+    while (true)
+    {
+        sockaddr_storage client_address;
+        socklen_t client_length = sizeof(client_address);
+
+        int client_fd = accept4(loop->server_fd, (sockaddr*)&client_address, &client_length,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1)
+        {
+            if (errno == EAGAIN)
+                return;
+            if (errno == ECONNABORTED || errno == EINTR)
+                continue;
+
+            // e.g. EMFILE - edge of pending backlog is consumed already, so listener is drained again
+            // by loop itself when some connection is closed
+            const int error = errno;
+            LOG_ERROR("accept4 failed with errno = %d", error);
+            loop->accept_paused = true;
+            loop->accept_paused_closed = loop->closed.load(std::memory_order_relaxed);
+            if (loop->accept_handler != NULL)
+                loop->accept_handler(error, NULL);
+            return;
+        }
+
+        accept_connection(loop, client_fd, &client_address, client_length);
+    }
+}
+
+/*
+ * io_uring backend. Completions replace readiness: multishot accept gives sockets, multishot
+   receive fills provided buffers (copied out at once, so idle connection doesn't hold any receive
+   buffer) and sendmsg completion reports written bytes. SQEs produced during iteration (new
+   receives, sends, cancels) are submitted together by next submit_and_wait.
+ */
+static void arm_accept(event_loop *loop)
+{
+    io_uring_sqe *sqe = get_sqe(&loop->ring, IORING_OP_ACCEPT, loop->server_fd,
+                                operation_data(uring_accept, 0));
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    loop->accepting = true;
+    loop->accept_paused = false;
+}
+
+static void complete_accept(event_loop *loop, const io_uring_cqe &cqe)
+{
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+        loop->accepting = false;
+
+    if (cqe.res >= 0)
+    {
+        accept_connection(loop, cqe.res, NULL, 0);
+        return;
+    }
+
+    LOG_ERROR("accept failed with errno = %d", -cqe.res);
+    // e.g. EMFILE - accept is armed again when some connection is closed, not in busy loop
+    loop->accept_paused = true;
+    loop->accept_paused_closed = loop->closed.load(std::memory_order_relaxed);
+    if (loop->accept_handler != NULL)
+        loop->accept_handler(-cqe.res, NULL);
+}
+
+// framed connection owns its data so bytes go there directly, otherwise they wait in inbound chain
+static void store_received(connection_data *connection, const char *bytes, size_t size)
+{
+    event_loop *loop = connection->loop;
+    if (connection->framing != frame_prefix::none)
+    {
+        buffer *data = &connection->data;
+        reserve_buffer(loop->pool, data, data->size + size);
+        memcpy(data->bytes + data->size, bytes, size);
+        data->size += size;
+        return;
+    }
+
+    segment_chain *chain = &connection->inbound;
+    while (size > 0)
+    {
+        if (chain->tail == NULL || chain->tail->data.size == chain->tail->data.capacity)
+            append_segment(loop, chain);
+        buffer *data = &chain->tail->data;
+        const size_t part = std::min(size, data->capacity - data->size);
+        memcpy(data->bytes + data->size, bytes, part);
+        data->size += part;
+        chain->size += part;
+        bytes += part;
+        size -= part;
+    }
+}
+
+static void complete_receive(event_loop *loop, connection_id id, const io_uring_cqe &cqe)
+{
+    connection_data *connection = &loop->slots[slot_index(id)];
+    const bool open = connection->id == id && connection->fd >= 0;
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+    {
+        const unsigned buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (open && cqe.res > 0)
+            store_received(connection, provided_buffer(&loop->ring, buffer_id), cqe.res);
+        recycle_provided_buffer(&loop->ring, buffer_id);
+    }
+    if (!open)
+        return;
+
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+        connection->receiving = false;
+    if (cqe.res == -ECANCELED)
+    {
+        // paused by high watermark (cancel on close changes id), armed again if resumed meanwhile
+        if (!connection->receive_paused)
+            arm_receive(connection);
+        return;
+    }
+
+    increment(loop->read_calls);
+    if (cqe.res > 0)
+    {
+        add(loop->bytes_read, cqe.res);
+        connection->bytes_read += cqe.res;
+        connection->readable = true;
+        touch(connection);
+        check_read_watermarks(connection);
+    }
+    else
+    if (cqe.res == -ENOBUFS)
+        // all provided buffers were taken, they are recycled in this batch so receive is just armed again
+        increment(loop->read_eagains);
+    else
+    {
+        connection->peer_closed = true;
+        connection->readable = true;
+    }
+
+    if (!connection->peer_closed && !connection->receiving && !connection->receive_paused)
+        arm_receive(connection);
+    if (connection->want_read && connection->readable)
+        schedule(connection);
+}
+
+static void complete_send(event_loop *loop, pending_send *pending, int result)
+{
+    connection_data *connection = &loop->slots[slot_index(pending->connection)];
+    if (connection->id == pending->connection && connection->fd >= 0)
+    {
+        // requests go back to front of queue, complete_write consumes what was written
+        pending->tail->next = connection->write_head;
+        connection->write_head = pending->head;
+        if (connection->write_tail == NULL)
+            connection->write_tail = pending->tail;
+        connection->writable = true;
+    }
+    else
+    {
+        connection = NULL;
+        while (pending->head != NULL)
+        {
+            write_request *request = pending->head;
+            pending->head = request->next;
+            free_write_request(loop, request);
+        }
+    }
+    pending->next = loop->free_sends;
+    loop->free_sends = pending;
+    if (connection == NULL)
+        return;
+
+    if (result < 0)
+    {
+        handle_write_failure(connection, -1, "Error during writing");
+        return;
+    }
+
+    assert(result > 0);
+    if (complete_write(connection, result) && connection->want_write)
+        schedule(connection);
+}
+
+/*
+ * Task of post (handler) or send (connection and data). Tasks are malloc-ed by producer - loop
+   releases them at any time later, so they can't come from producer's pool which dies with its thread.
+ * send data (request.data) is buffer of loop's own pool or (copied) - bytes which follow task in
+   the same block. Copied data is queued by request of task itself, so task lives until it's written.
+ */
+struct posted_task
+{
+	posted_task *next;
+	t_post_handler handler;
+	connection_id connection;
+	write_request request;
+	bool copied;
+};
+
+static void arm_post_poll(event_loop *loop)
+{
+	io_uring_sqe *sqe = get_sqe(&loop->ring, IORING_OP_POLL_ADD, loop->post_fd, operation_data(uring_post, 0));
+	sqe->poll32_events = POLLIN;
+}
+
+/*
+ * send() data becomes silent write request: own buffer is taken over by request of loop, copied
+   bytes are queued in place by request of task. Task is released here or with its request.
+ */
+static void queue_posted_data(event_loop *loop, posted_task *task)
+{
+	connection_data *connection = find_connection(task->connection);
+	buffer *data = &task->request.data;
+	if (connection != NULL && data->start < data->size)
+	{
+		if (task->copied)
+		{
+			task->request.next = NULL;
+			task->request.notify = false;
+			task->request.block = task;
+			enqueue_write_request(connection, &task->request);
+			return;
+		}
+		write_request *request = allocate_write_request(loop);
+		std::swap(request->data, *data);
+		request->notify = false;
+		enqueue_write_request(connection, request);
+	}
+	if (!task->copied)
+		free_buffer(data);
+	free(task);
+}
+
+// stack gives tasks newest first, reversed list is in order of posting
+static posted_task *take_posted_tasks(event_loop *loop)
+{
+	posted_task *task = loop->posted.exchange(NULL, std::memory_order_acquire);
+	posted_task *ordered = NULL;
+	while (task != NULL)
+	{
+		posted_task *next = task->next;
+		task->next = ordered;
+		ordered = task;
+		task = next;
+	}
+	return ordered;
+}
+
+/*
+ * post_fd is read before queue is taken, so task pushed in between either is in taken batch or
+   finds queue empty and signals again - wakeup is never lost.
+ */
+static void run_posted_tasks(event_loop *loop)
+{
+	uint64_t value;
+	if (read(loop->post_fd, &value, sizeof(value)) == sizeof(value))
+		increment(loop->post_wakeups);
+
+	posted_task *task = take_posted_tasks(loop);
+	while (task != NULL)
+	{
+		posted_task *next = task->next;
+		increment(loop->posted_tasks);
+		if (task->handler != NULL)
+		{
+			task->handler();
+			free(task);
+		}
+		else
+			queue_posted_data(loop, task);
+		task = next;
+	}
+}
+
+// tasks which came after loop stopped are not run, data of sends is only released
+static void drop_posted_tasks(event_loop *loop)
+{
+	posted_task *task = take_posted_tasks(loop);
+	while (task != NULL)
+	{
+		posted_task *next = task->next;
+		if (task->handler == NULL && !task->copied)
+			free_buffer(&task->request.data);
+		free(task);
+		task = next;
+	}
+}
+
+// every completion is copied and released before it's handled, so handlers may queue new SQEs freely
+static int process_completions(event_loop *loop)
+{
+    int n = 0;
+    for (io_uring_cqe *entry = peek_cqe(&loop->ring); entry != NULL; entry = peek_cqe(&loop->ring))
+    {
+        const io_uring_cqe cqe = *entry;
+        advance_cqe(&loop->ring);
+        n++;
+
+        const uint64_t value = cqe.user_data & operation_value_mask;
+        switch (cqe.user_data >> 56)
+        {
+        case uring_accept:
+            complete_accept(loop, cqe);
+            break;
+        case uring_receive:
+            complete_receive(loop, make_connection_id(loop->id, generation(value), slot_index(value)), cqe);
+            break;
+        case uring_send:
+            complete_send(loop, (pending_send *) value, cqe.res);
+            break;
+        case uring_post:
+            run_posted_tasks(loop);
+            arm_post_poll(loop);
+            break;
+        default:
+            // wakeup (loop checks interrupted anyway) or failed cancel of finished receive
+            break;
+        }
+    }
+    return n;
+}
+
+static void interrupt_handler(int , siginfo_t *, void *)
+{
+	interrupted = true;
+}
+
+static void init_loop(event_loop *loop, int id, int port)
+{
+    loop->id = id;
+    loop->ready_head = loop->ready_tail = NULL;
+    loop->deferred_head = loop->deferred_tail = NULL;
+    loop->round = 1;
+    loop->free_requests = NULL;
+    loop->epoll_ctl_calls = loop->messages = loop->write_calls = loop->read_calls = 0;
+    loop->bytes_read = loop->bytes_written = loop->read_eagains = loop->write_eagains = 0;
+    loop->read_pauses = loop->budget_exhausted = 0;
+    loop->posted_tasks = loop->post_wakeups = 0;
+    loop->reallocations = loop->wakeups = loop->events_number = 0;
+    loop->accepted = loop->rejected = loop->closed = 0;
+    loop->next_dump_ms = 0;
+    loop->last_dump = transport_stats {};
+    loop->pool = new memory_pool;
+    init_pool(loop->pool);
+
+    loop->slots = (connection_data *) calloc(options.max_connections, sizeof(connection_data));
+    loop->free_slots = (uint32_t *) malloc(options.max_connections * sizeof(uint32_t));
+    assert(loop->slots != NULL && loop->free_slots != NULL);
+    loop->free_slots_number = loop->slots_used = 0;
+
+    loop->server_fd = resolve_name_and_bind(port, loops_number > 1);
+
+    int return_code = listen (loop->server_fd, options.listen_backlog);
+    check_errors("listen", return_code);
+
+    loop->posted.store(NULL, std::memory_order_relaxed);
+    loop->post_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    check_errors("eventfd", loop->post_fd);
+
+    loop->free_sends = NULL;
+    loop->accepting = loop->accept_paused = false;
+    loop->accept_paused_closed = 0;
+    if (backend == io_backend::io_uring)
+    {
+        // listener, wakeup_fd and post_fd are armed by loop itself, there is no epoll instance at all
+        loop->epoll_fd = -1;
+        loop->events = NULL;
+        return_code = setup_io_ring(&loop->ring, URINGENTRIES, URINGCOMPLETIONS, options.sqpoll);
+        if (return_code == 0)
+            return_code = setup_provided_buffers(&loop->ring, URINGBUFFERS, URINGBUFFERLEN);
+        if (return_code < 0)
+            errno = -return_code;
+        check_errors("io_uring_setup", return_code);
+        return;
+    }
+
+	loop->epoll_fd = epoll_create (1);
+    check_errors("epoll_create", loop->epoll_fd);
+
+    modify_epoll_context(loop, EPOLL_CTL_ADD, loop->server_fd, EPOLLIN, listener_id);
+    modify_epoll_context(loop, EPOLL_CTL_ADD, wakeup_fd, EPOLLIN, wakeup_id);
+    modify_epoll_context(loop, EPOLL_CTL_ADD, loop->post_fd, EPOLLIN, post_id);
+    loop->events = (epoll_event *)calloc(MAXEVENTS, sizeof(epoll_event));
+}
+
+static void destroy_loop(event_loop *loop)
+{
+	set_thread_pool(loop->pool);
+	for (uint32_t i = 0; i < loop->slots_used; i++)
+	{
+		if (loop->slots[i].fd >= 0)
+			free_connection(&loop->slots[i]);
+		loop->slots[i].~connection_data();
+	}
+	free(loop->slots);
+	free(loop->free_slots);
+	loop->slots = NULL;
+	loop->free_slots = NULL;
+
+	drop_posted_tasks(loop);
+	close(loop->post_fd);
+	loop->post_fd = -1;
+
+	handle_server_closing(loop->server_fd);
+	if (backend == io_backend::io_uring)
+		// cancels multishot operations and sends still in flight (their requests are freed with pool)
+		destroy_io_ring(&loop->ring);
+	else
+		close(loop->epoll_fd);
+
+	free(loop->events);
+	loop->events = NULL;
+
+	set_thread_pool(NULL);
+	destroy_pool(loop->pool);
+	delete loop->pool;
+	loop->pool = NULL;
+}
+
+static void pin_current_thread(int core)
+{
+	cpu_set_t cpu_set;
+	CPU_ZERO(&cpu_set);
+	CPU_SET(core % std::thread::hardware_concurrency(), &cpu_set);
+
+	int return_code = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+	if (return_code != 0)
+		LOG_WARN("Pinning loop to core %d failed", core);
+}
+
+// wakes all loops - wakeup_fd is registered in every epoll instance and is never read
+static void wake_up_loops()
+{
+	uint64_t value = 1;
+	int return_code = write(wakeup_fd, &value, sizeof(value));
+	assert(return_code == sizeof(value));
+}
+
+void init(int port)
+{
+	init(port, transport_options());
+}
+
+void init(int port, int loops_number_, bool pin_loops)
+{
+	transport_options options;
+	options.loops_number = loops_number_;
+	options.pin_loops = pin_loops;
+	init(port, options);
+}
+
+void init(int port, const transport_options &options_)
+{
+    assert(options_.loops_number > 0 && options_.loops_number <= 256 && loops == NULL);
+    assert(options_.max_connections > 0);
+    assert(options_.read_low_watermark > 0 && options_.read_low_watermark <= options_.read_high_watermark);
+    assert(options_.round_budget_bytes > 0 && options_.round_budget_calls > 0);
+    options = options_;
+    loops_number = options.loops_number;
+    backend = options.backend;
+    if (backend == io_backend::io_uring && !io_ring_supported())
+    {
+        LOG_WARN("io_uring (with multishot receive and provided buffer rings) is not supported, "
+                 "falling back to epoll");
+        backend = io_backend::epoll;
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    check_errors("eventfd", wakeup_fd);
+
+    loops = new event_loop[loops_number];
+    for (int i = 0; i < loops_number; i++)
+        init_loop(&loops[i], i, port);
+    LOG_INFO("Memory pools are ready");
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	sigemptyset(&action.sa_mask);
+	action.sa_sigaction = &interrupt_handler;
+	action.sa_flags = SA_SIGINFO;
+
+	int return_code = sigaction(SIGINT, &action, NULL);
+	check_errors("sigaction SIGINT", return_code);
+
+	return_code = sigaction(SIGTERM, &action, NULL);
+	check_errors("sigaction SIGTERM", return_code);
+
+    LOG_INFO("%d %s event loop(s) ready. Waiting for connections on port = %d...", loops_number,
+             (backend == io_backend::io_uring)? "io_uring" : "epoll", port);
+}
+
+/*
+ * One line per loop every stats_interval_ms: rates are computed from difference with previous dump,
+   sizes per syscall from totals.
+ */
+static void dump_stats(event_loop *loop)
+{
+	const transport_stats stats = get_loop_stats(loop->id);
+	const transport_stats &last = loop->last_dump;
+	const double seconds = options.stats_interval_ms / 1000.0;
+	LOG_INFO("loop %d: %zu connections (%.1f accepts/s, %zu rejected), %.1f messages/s, "
+			 "in %.1f KB/s (%.1f B/read, %zu EAGAIN, %zu paused), out %.1f KB/s (%.1f B/write, %zu EAGAIN), "
+			 "%zu budget cuts, %zu posted (%zu wakeups), %.2f events/wakeup, %zu reallocations, pool %zu B",
+			 loop->id, stats.active_connections, (stats.accepted - last.accepted) / seconds,
+			 stats.rejected, (stats.messages - last.messages) / seconds,
+			 (stats.bytes_read - last.bytes_read) / seconds / 1024,
+			 stats.read_calls? double(stats.bytes_read) / stats.read_calls : 0.0, stats.read_eagains,
+			 stats.read_pauses,
+			 (stats.bytes_written - last.bytes_written) / seconds / 1024,
+			 stats.write_calls? double(stats.bytes_written) / stats.write_calls : 0.0, stats.write_eagains,
+			 stats.budget_exhausted, stats.posted_tasks, stats.post_wakeups,
+			 stats.wakeups? double(stats.events) / stats.wakeups : 0.0, stats.reallocations,
+			 stats.pool_bytes_in_use);
+	loop->last_dump = stats;
+	loop->next_dump_ms = cached_clock().monotonic_ms + options.stats_interval_ms;
+}
+
+// sleep until first timer may be due or until next stats dump, -1 - nothing to wait for
+static int loop_timeout(event_loop *loop)
+{
+    // deferred connections only check for new events
+    if (loop->ready_head != NULL)
+        return 0;
+    int timeout = next_timer_timeout(&loop->timers);
+    if (options.stats_interval_ms > 0)
+    {
+        const uint64_t now = cached_clock().monotonic_ms;
+        const int dump = (loop->next_dump_ms > now)? int(loop->next_dump_ms - now) : 0;
+        if (timeout < 0 || dump < timeout)
+            timeout = dump;
+    }
+    return timeout;
+}
+
+// every wakeup: handlers of batch (and logger) read time from here
+static void start_iteration(event_loop *loop)
+{
+    update_cached_clock();
+    loop->round++;
+    // buffers released by other threads since last iteration
+    collect_remote_frees(loop->pool);
+    increment(loop->wakeups);
+    if (options.stats_interval_ms > 0 && cached_clock().monotonic_ms >= loop->next_dump_ms)
+        dump_stats(loop);
+}
+
+static void run_epoll_loop(event_loop *loop)
+{
+    epoll_event *events = loop->events;
 
 	while(!interrupted)
     {
-        int n = epoll_wait(epoll_fd, events, MAXEVENTS, -1);
+        const int timeout = loop_timeout(loop);
+        int n = epoll_wait(loop->epoll_fd, events, MAXEVENTS, timeout);
         assert(n >= 0 || (n == -1 && errno == EINTR));
+        start_iteration(loop);
+        if (n > 0)
+            add(loop->events_number, n);
 
-        if (n == 0)
+        if (n == 0 && timeout < 0)
         {
-            logger_.log("Timeout");
+            LOG_ERROR("Timeout");
             assert(false);
         }
 
         for(int i = 0; i < n; i++)
         {
-            if(EPOLLIN & events[i].events)
+            if (events[i].data.u64 == wakeup_id)
+                continue;
+
+            if (events[i].data.u64 == post_id)
+            {
+                run_posted_tasks(loop);
+                continue;
+            }
+
+            if(events[i].data.u64 == listener_id)
             {
-                if(events[i].data.ptr == &server_fd)
-                {
-                    new_handle_accepting_connection(server_fd, client_event, server_event);
-                }
-                else
-                {
-                    connection_data* connection = (connection_data*) events[i].data.ptr;
-
-                    connection->event = EPOLLIN;
-                    modify_epoll_context(epoll_fd, EPOLL_CTL_DEL, connection->fd, 0, 0);
-                    handle_reading_data_from_event(connection);
-                }
+                handle_accepting_connections(loop);
+                continue;
             }
-            else
-                if(EPOLLOUT & events[i].events)
-                {
-                    connection_data* connection = (connection_data*) events[i].data.ptr;
-
-                    connection->event = EPOLLOUT;
-                    modify_epoll_context(epoll_fd, EPOLL_CTL_DEL, connection->fd, 0, 0);
-
-                    if (!handle_writing_data_to_event(connection))
-                    {
-                        modify_epoll_context(epoll_fd, EPOLL_CTL_ADD, connection->fd, EPOLLOUT,
-                                             connection);
-                    }
-                }
-                else
-                {
-                    if(events[i].events & EPOLLHUP || events[i].events & EPOLLERR)
-                    {
-                        connection_data* connection = (connection_data*) events[i].data.ptr;
-                        handle_closing(connection);
-                    }
-                }
+
+            connection_data* connection = &loop->slots[slot_index(events[i].data.u64)];
+            // connection was closed by handler of previous event from this batch (and slot may
+            // be reused already by new connection - then generation doesn't match)
+            if (connection->id != events[i].data.u64 || connection->fd < 0)
+                continue;
+
+            connection->event = events[i].events;
+            if ((events[i].events & (EPOLLHUP | EPOLLERR)) && !(events[i].events & EPOLLIN))
+            {
+                handle_closing(connection);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+                connection->readable = true;
+            if (events[i].events & EPOLLOUT)
+                connection->writable = true;
+            process_connection(connection);
+        }
+
+        // timer handlers may queue writes, so they run before ready list is processed
+        advance_timer_wheel(&loop->timers, cached_clock().monotonic_ms);
+        process_ready_connections(loop);
+
+        if (loop->accept_paused && loop->closed.load(std::memory_order_relaxed) != loop->accept_paused_closed)
+        {
+            loop->accept_paused = false;
+            handle_accepting_connections(loop);
         }
     }
+}
+
+/*
+ * One io_uring_enter per iteration submits everything what previous iteration produced and waits
+   for completions. wakeup_fd is polled once - it's never read, so it's used only to stop loop.
+   post_fd is read and polled again after every wakeup.
+ */
+static void run_uring_loop(event_loop *loop)
+{
+    arm_accept(loop);
+    io_uring_sqe *sqe = get_sqe(&loop->ring, IORING_OP_POLL_ADD, wakeup_fd, operation_data(uring_wakeup, 0));
+    sqe->poll32_events = POLLIN;
+    arm_post_poll(loop);
+
+    while (!interrupted)
+    {
+        int return_code = submit_and_wait(&loop->ring, loop_timeout(loop));
+        assert(return_code == 0 || return_code == -EINTR || return_code == -ETIME);
+        (void)return_code;
+        start_iteration(loop);
+
+        const int n = process_completions(loop);
+        if (n > 0)
+            add(loop->events_number, n);
+        advance_timer_wheel(&loop->timers, cached_clock().monotonic_ms);
+        process_ready_connections(loop);
+
+        if (!loop->accepting &&
+            (!loop->accept_paused || loop->closed.load(std::memory_order_relaxed) != loop->accept_paused_closed))
+            arm_accept(loop);
+    }
+}
+
+static void run_loop(event_loop *loop)
+{
+    current_loop = loop;
+    set_thread_pool(loop->pool);
+    if (options.pin_loops)
+        pin_current_thread(loop->id);
+
+    update_cached_clock();
+    loop->next_dump_ms = cached_clock().monotonic_ms + options.stats_interval_ms;
+    init_timer_wheel(&loop->timers, cached_clock().monotonic_ms);
+
+    if (backend == io_backend::io_uring)
+        run_uring_loop(loop);
+    else
+        run_epoll_loop(loop);
+
+    // loop which noticed interruption first wakes up rest of them
+    wake_up_loops();
+    release_cached_clock();
+    LOG_INFO("Loop %d accepted %zu connections", loop->id, loop->accepted.load(std::memory_order_relaxed));
+}
+
+void run()
+{
+	assert(loops != NULL);
+	for (int i = 0; i < loops_number; i++)
+		loops[i].accept_handler = global_accept_handler;
+
+	// signals should interrupt epoll_wait only in thread which called run()
+	sigset_t blocked, previous;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+	for (int i = 1; i < loops_number; i++)
+		loops[i].thread = std::thread(run_loop, &loops[i]);
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+	run_loop(&loops[0]);
+
+	for (int i = 0; i < loops_number; i++)
+	{
+		if (loops[i].thread.joinable())
+			loops[i].thread.join();
+	}
+	last_run_stats = get_stats();
+	for (int i = 0; i < loops_number; i++)
+		destroy_loop(&loops[i]);
+	LOG_INFO("Accepted %zu connections", last_run_stats.accepted);
+	LOG_INFO("%zu epoll_ctl calls for %zu messages", last_run_stats.epoll_ctl_calls,
+				last_run_stats.messages);
+	LOG_INFO("Events are destroyed");
+	LOG_INFO("Memory pools are destroyed");
+
+	delete [] loops;
+	loops = NULL;
+	close(wakeup_fd);
+	wakeup_fd = -1;
+	interrupted = false;
+}
+
+io_backend active_backend()
+{
+	return backend;
+}
+
+void stop()
+{
+	// run() returned already (e.g. late signal or test teardown), next run mustn't see interrupted
+	if (wakeup_fd == -1)
+		return;
+	interrupted = true;
+	wake_up_loops();
+}
+
+static void accumulate(transport_stats *sum, const transport_stats &stats)
+{
+	sum->epoll_ctl_calls += stats.epoll_ctl_calls;
+	sum->messages += stats.messages;
+	sum->write_calls += stats.write_calls;
+	sum->read_calls += stats.read_calls;
+	sum->bytes_read += stats.bytes_read;
+	sum->bytes_written += stats.bytes_written;
+	sum->read_eagains += stats.read_eagains;
+	sum->read_pauses += stats.read_pauses;
+	sum->budget_exhausted += stats.budget_exhausted;
+	sum->posted_tasks += stats.posted_tasks;
+	sum->post_wakeups += stats.post_wakeups;
+	sum->write_eagains += stats.write_eagains;
+	sum->reallocations += stats.reallocations;
+	sum->wakeups += stats.wakeups;
+	sum->events += stats.events;
+	sum->accepted += stats.accepted;
+	sum->rejected += stats.rejected;
+	sum->active_connections += stats.active_connections;
+	sum->pool_bytes_in_use += stats.pool_bytes_in_use;
+}
 
-	logger_.log("Accepted %d connections", connections);
+transport_stats get_loop_stats(int loop_index)
+{
+	assert(loops != NULL && loop_index >= 0 && loop_index < loops_number);
+	event_loop *loop = &loops[loop_index];
+	transport_stats stats = {};
+	stats.epoll_ctl_calls = loop->epoll_ctl_calls.load(std::memory_order_relaxed);
+	stats.messages = loop->messages.load(std::memory_order_relaxed);
+	stats.write_calls = loop->write_calls.load(std::memory_order_relaxed);
+	stats.read_calls = loop->read_calls.load(std::memory_order_relaxed);
+	stats.bytes_read = loop->bytes_read.load(std::memory_order_relaxed);
+	stats.bytes_written = loop->bytes_written.load(std::memory_order_relaxed);
+	stats.read_eagains = loop->read_eagains.load(std::memory_order_relaxed);
+	stats.read_pauses = loop->read_pauses.load(std::memory_order_relaxed);
+	stats.budget_exhausted = loop->budget_exhausted.load(std::memory_order_relaxed);
+	stats.posted_tasks = loop->posted_tasks.load(std::memory_order_relaxed);
+	stats.post_wakeups = loop->post_wakeups.load(std::memory_order_relaxed);
+	stats.write_eagains = loop->write_eagains.load(std::memory_order_relaxed);
+	stats.reallocations = loop->reallocations.load(std::memory_order_relaxed);
+	stats.wakeups = loop->wakeups.load(std::memory_order_relaxed);
+	stats.events = loop->events_number.load(std::memory_order_relaxed);
+	stats.accepted = loop->accepted.load(std::memory_order_relaxed);
+	stats.rejected = loop->rejected.load(std::memory_order_relaxed);
+	stats.active_connections = stats.accepted - loop->closed.load(std::memory_order_relaxed);
+	stats.pool_bytes_in_use = loop->pool->bytes_in_use.load(std::memory_order_relaxed);
+	return stats;
+}
 
-	free(events);
-	events = NULL;
-	logger_.log("Events are destroyed");
+transport_stats get_stats()
+{
+	if (loops == NULL)
+		return last_run_stats;
+
+	transport_stats stats = {};
+	for (int i = 0; i < loops_number; i++)
+		accumulate(&stats, get_loop_stats(i));
+	return stats;
+}
+
+buffer detach_buffer(connection_data *connection)
+{
+    assert(connection != NULL && connection->loop == current_loop);
+    buffer result = connection->data;
+    allocate_buffer(connection->loop->pool, &connection->data);
+    return result;
+}
+
+void release_buffer(buffer *data)
+{
+    free_buffer(data);
+}
 
-	destroy_pool(pool);
-	free(pool);
-	logger_.log("Memory pool is destroyed");
+int peer_address(const connection_data *connection, char *host, size_t host_size,
+                 char *port, size_t port_size)
+{
+    if (connection->peer_length == 0)
+    {
+        // accepted by io_uring, address is asked for only when somebody needs it
+        sockaddr_storage peer;
+        socklen_t peer_length = sizeof(peer);
+        if (getpeername(connection->fd, (sockaddr*)&peer, &peer_length) != 0)
+            return EAI_SYSTEM;
+        return getnameinfo ((const sockaddr*)&peer, peer_length, host, host_size, port, port_size,
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+    }
+    return getnameinfo ((const sockaddr*)&connection->peer, connection->peer_length,
+                        host, host_size, port, port_size,
+                        NI_NUMERICHOST | NI_NUMERICSERV);
 }
 
 void async_accept( t_accept_handler accept_handler )
@@ -419,23 +2030,354 @@ void async_accept( t_accept_handler accept_handler )
    so from sender POV all data may be send (by async_write) in one call but from reciever POV there may be
    need to perform many async_read (and vice versa). If caller won't copy data from connection or
    won't move connection->from next async_read overwrite previous data in buffer.
+ * Must be called from thread of loop which owns connection (e.g. from handler).
  */
 void async_read( t_read_handler read_handler, connection_data *connection)
 {
-    assert(connection != NULL && epoll_fd != 0);
-    modify_epoll_context(epoll_fd, EPOLL_CTL_ADD, connection->fd, EPOLLIN, connection);
-    global_read_handler = read_handler;
+    assert(connection != NULL);
+    connection->read_handler = read_handler;
+    async_read(connection);
+}
+
+void async_read(connection_data *connection)
+{
+    assert(connection != NULL && connection->loop == current_loop);
+    connection->framing = frame_prefix::none;
+    connection->want_read = true;
+    start_read_deadline(connection);
+    if (connection->readable)
+        schedule(connection);
 }
 
 /*
- * Writes all data available in connection buffer (connection->size bytes) to kernel. There is no message concept
+ * Writes all data available in connection buffer (from data.start to data.size) to kernel. There is no message concept
    so from sender POV all data may be send in many calls (by async_write) but from reciever POV only one async_read
-   may be sufficient (and vice versa). If caller won't move connection->from and connection->size
-   next async_write send excatly the same data (but as I noticed behaviour on receiver side may be different).
+   may be sufficient (and vice versa). Data is queued so many async_write may be issued before first one completes.
+   Write handler is called once per queued buffer.
+ * Must be called from thread of loop which owns connection (e.g. from handler).
  */
 void async_write( t_write_handler write_handler, connection_data *connection)
 {
-    assert(connection != NULL && epoll_fd != 0);
-	modify_epoll_context(epoll_fd, EPOLL_CTL_ADD, connection->fd, EPOLLOUT, connection);
-    global_write_handler = write_handler;
+    assert(connection != NULL);
+    connection->write_handler = write_handler;
+    async_write(connection);
+}
+
+/*
+ * Content of connection->data goes to outbound queue without copying (buffers are swapped) and
+   connection->data becomes empty buffer ready for next message. So caller may produce and
+   queue next response before previous one was drained.
+ */
+void async_write(connection_data *connection)
+{
+    assert(connection != NULL && connection->loop == current_loop);
+    assert(connection->framing == frame_prefix::none);
+    assert(connection->data.start < connection->data.size);
+
+    write_request *request = allocate_write_request(connection->loop);
+    std::swap(request->data, connection->data);
+    enqueue_write_request(connection, request);
+}
+
+static write_request *copy_to_write_request(connection_data *connection, const char *bytes, size_t size)
+{
+    assert(connection != NULL && connection->loop == current_loop && size > 0);
+
+    event_loop *loop = connection->loop;
+    write_request *request = allocate_write_request(loop);
+    reserve_buffer(loop->pool, &request->data, size);
+    memcpy(request->data.bytes, bytes, size);
+    request->data.size = size;
+    return request;
+}
+
+void async_write(t_write_handler write_handler, connection_data *connection,
+                 const char *bytes, size_t size)
+{
+    write_request *request = copy_to_write_request(connection, bytes, size);
+    connection->write_handler = write_handler;
+    enqueue_write_request(connection, request);
+}
+
+// data of send task's request (block) is not in pool, so it can't grow
+static bool appendable(write_request *tail, size_t size)
+{
+    return tail != NULL && !tail->notify && tail->block == NULL && tail->data.size + size <= MAXCACHEDLEN;
+}
+
+/*
+ * Silent requests are coalesced: bytes are appended to silent tail of queue (up to MAXCACHEDLEN),
+   so many small pipelined responses end up in few buffers and one sendmsg.
+ */
+void queue_write(connection_data *connection, const char *bytes, size_t size)
+{
+    write_request *tail = connection->write_tail;
+    if (appendable(tail, size))
+    {
+        assert(connection->loop == current_loop);
+        reserve_buffer(connection->loop->pool, &tail->data, tail->data.size + size);
+        memcpy(tail->data.bytes + tail->data.size, bytes, size);
+        tail->data.size += size;
+        return;
+    }
+
+    write_request *request = copy_to_write_request(connection, bytes, size);
+    request->notify = false;
+    enqueue_write_request(connection, request);
+}
+
+buffer *prepare_write(connection_data *connection, size_t size)
+{
+    assert(connection != NULL && connection->loop == current_loop);
+    event_loop *loop = connection->loop;
+    write_request *request = connection->prepared;
+    if (request == NULL)
+    {
+        write_request *tail = connection->write_tail;
+        connection->prepared_queued = appendable(tail, size);
+        if (connection->prepared_queued)
+            request = tail;
+        else
+        {
+            request = allocate_write_request(loop);
+            request->notify = false;
+        }
+        connection->prepared = request;
+    }
+    reserve_buffer(loop->pool, &request->data, request->data.size + size);
+    return &request->data;
+}
+
+void commit_write(connection_data *connection, size_t size)
+{
+    write_request *request = connection->prepared;
+    assert(request != NULL && connection->loop == current_loop);
+    assert(request->data.size + size <= request->data.capacity);
+    connection->prepared = NULL;
+
+    request->data.size += size;
+    if (connection->prepared_queued)
+    {
+        assert(request == connection->write_tail);
+        return;
+    }
+
+    if (request->data.size > 0)
+        enqueue_write_request(connection, request);
+    else
+        free_write_request(connection->loop, request);
+}
+
+void set_segmented_reads(connection_data *connection, bool enabled)
+{
+    assert(connection != NULL && connection->loop == current_loop);
+    connection->segmented = enabled;
+    release_segments(connection->loop, &connection->segments);
+}
+
+const char *contiguous_view(connection_data *connection)
+{
+    assert(connection != NULL && connection->loop == current_loop);
+    segment_chain *chain = &connection->segments;
+    if (!connection->segmented || chain->head == NULL)
+        return connection->data.bytes;
+
+    buffer *data = &connection->data;
+    data->start = data->size = 0;
+    reserve_buffer(connection->loop->pool, data, chain->size);
+    for (write_request *segment = chain->head; segment != NULL; segment = segment->next)
+    {
+        memcpy(data->bytes + data->size, segment->data.bytes, segment->data.size);
+        data->size += segment->data.size;
+    }
+    release_segments(connection->loop, chain);
+    return data->bytes;
+}
+
+void async_write_segments(connection_data *connection)
+{
+    assert(connection != NULL && connection->loop == current_loop);
+    segment_chain *chain = &connection->segments;
+    assert(chain->head != NULL);
+
+    // last segment may be empty (read which hit EAGAIN got fresh segment)
+    write_request *segment = chain->head;
+    while (segment != NULL)
+    {
+        write_request *next = segment->next;
+        segment->next = NULL;
+        if (segment->data.size == 0)
+            free_write_request(connection->loop, segment);
+        else
+        {
+            segment->notify = (next == NULL || next->data.size == 0);
+            enqueue_write_request(connection, segment);
+        }
+        segment = next;
+    }
+    chain->head = chain->tail = NULL;
+    chain->size = 0;
+}
+
+void async_read_frames(t_frame_handler frame_handler, connection_data *connection,
+                       frame_prefix prefix, size_t max_frame_size)
+{
+    assert(connection != NULL && connection->loop == current_loop);
+    assert(prefix != frame_prefix::none && !connection->segmented);
+
+    if (connection->framing == frame_prefix::none)
+        connection->data.start = connection->data.size = 0;
+    connection->framing = prefix;
+    connection->max_frame_size = max_frame_size;
+    connection->frame_handler = frame_handler;
+    connection->want_read = true;
+    start_read_deadline(connection);
+    if (connection->readable)
+        schedule(connection);
+}
+
+void set_timeouts(connection_data *connection, uint32_t idle_ms, uint32_t read_ms, uint32_t write_ms)
+{
+    assert(connection != NULL && connection->loop == current_loop);
+    const uint64_t now = cached_clock().monotonic_ms;
+    connection->idle_timeout = idle_ms;
+    connection->read_timeout = read_ms;
+    connection->write_timeout = write_ms;
+    // deadlines which are running already are measured from now
+    connection->last_activity = now;
+    if (connection->read_deadline != 0)
+        connection->read_deadline = read_ms? now + read_ms : 0;
+    if (connection->write_deadline != 0)
+        connection->write_deadline = write_ms? now + write_ms : 0;
+    else
+        if (write_ms != 0 && connection->want_write)
+            connection->write_deadline = now + write_ms;
+
+    unschedule_timer(&connection->loop->timers, &connection->timer);
+    arm_deadline(connection, earliest_deadline(connection));
+}
+
+void set_read_watermarks(connection_data *connection, size_t high, size_t low)
+{
+    assert(connection != NULL && connection->loop == current_loop);
+    assert(low > 0 && low <= high);
+    connection->read_high_watermark = high;
+    connection->read_low_watermark = low;
+    if (backend == io_backend::io_uring)
+        check_read_watermarks(connection);
+}
+
+struct loop_timer
+{
+    timer_node node;
+    t_timer_handler handler;
+    uint32_t period;
+};
+
+static void loop_timer_expired(timer_node *node)
+{
+    loop_timer *timer = (loop_timer *) node->owner;
+    t_timer_handler handler = timer->handler;
+    if (timer->period > 0)
+    {
+        // armed again before handler runs so handler may cancel it; periods missed by busy loop are skipped
+        const uint64_t now = cached_clock().monotonic_ms;
+        uint64_t next = node->expires + timer->period;
+        if (next <= now)
+            next = now + timer->period;
+        schedule_timer(&current_loop->timers, node, next);
+    }
+    else
+        deallocate(timer, sizeof(loop_timer));
+    handler();
+}
+
+loop_timer *add_timer(uint32_t delay_ms, uint32_t period_ms, t_timer_handler handler)
+{
+    event_loop *loop = current_loop;
+    assert(loop != NULL && handler != nullptr);
+    loop_timer *timer = new (allocate(loop->pool, sizeof(loop_timer))) loop_timer();
+    timer->node.expire = loop_timer_expired;
+    timer->node.owner = timer;
+    timer->handler = handler;
+    timer->period = period_ms;
+    schedule_timer(&loop->timers, &timer->node, cached_clock().monotonic_ms + delay_ms);
+    return timer;
+}
+
+void cancel_timer(loop_timer *timer)
+{
+    assert(timer != NULL && current_loop != NULL);
+    unschedule_timer(&current_loop->timers, &timer->node);
+    deallocate(timer, sizeof(loop_timer));
+}
+
+static void push_task(int loop_index, posted_task *task)
+{
+	assert(loops != NULL && loop_index >= 0 && loop_index < loops_number);
+	event_loop *loop = &loops[loop_index];
+	// task may be taken (and freed) by loop just after push, so only local copy of old head is checked
+	posted_task *head = loop->posted.load(std::memory_order_relaxed);
+	do
+		task->next = head;
+	while (!loop->posted.compare_exchange_weak(head, task, std::memory_order_release,
+											   std::memory_order_relaxed));
+
+	// loop which has something in queue was signalled already
+	if (head == NULL)
+	{
+		uint64_t value = 1;
+		int return_code = write(loop->post_fd, &value, sizeof(value));
+		assert(return_code == sizeof(value));
+		(void)return_code;
+	}
+}
+
+// payload_size bytes after task are for copied send data
+static posted_task *allocate_task(size_t payload_size = 0)
+{
+	posted_task *task = (posted_task *) malloc(sizeof(posted_task) + payload_size);
+	assert(task != NULL);
+	return new (task) posted_task();
+}
+
+void post(int loop, t_post_handler handler)
+{
+	assert(handler != NULL);
+	posted_task *task = allocate_task();
+	task->handler = handler;
+	push_task(loop, task);
+}
+
+/*
+ * Buffer of any other pool than loop's one is copied and released here, on caller's thread - its
+   pool (e.g. thread_pool of worker) may be destroyed with its thread before loop takes task.
+ */
+void send(connection_id id, buffer *data)
+{
+	assert(data != NULL && data->bytes != NULL);
+	assert(loops != NULL && loop_index(id) < loops_number);
+	posted_task *task;
+	if (owner_of(data->bytes, data->capacity) == loops[loop_index(id)].pool)
+	{
+		task = allocate_task();
+		task->request.data = *data;
+	}
+	else
+	{
+		const size_t size = data->size - data->start;
+		task = allocate_task(size);
+		task->copied = true;
+		task->request.data = buffer {size, 0, size, reinterpret_cast<char *>(task + 1)};
+		memcpy(task->request.data.bytes, data->bytes + data->start, size);
+		free_buffer(data);
+	}
+	task->connection = id;
+	*data = buffer {0, 0, 0, NULL};
+	push_task(loop_index(id), task);
+}
+
+int connection_loop(connection_id id)
+{
+	return loop_index(id);
 }
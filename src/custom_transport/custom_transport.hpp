@@ -2,12 +2,26 @@
 #define CUSTOM_TRANSPORT_HPP
 
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <cstdint>
 #include <functional>
+#include "inline_function.hpp"
+#include "framing.hpp"
+#include "timer_wheel.hpp"
 
-#define MAXCONN 200
 #define MAXEVENTS 128
+// default read high watermark (see transport_options::read_high_watermark)
 #define MAXLEN (1024u*1024u)
 #define STARTLEN (512u)
+// recycled write requests keep buffers up to this capacity
+#define MAXCACHEDLEN (64u*1024u)
+#define SEGMENTLEN (16u*1024u)
+#define MAXIOV 64
+// io_uring backend (per loop): submission and completion ring sizes, provided receive buffers
+#define URINGENTRIES 1024
+#define URINGCOMPLETIONS (8u*1024u)
+#define URINGBUFFERS 512
+#define URINGBUFFERLEN (8u*1024u)
 
 /**
  * buffer used to store incoming / outgoing data per connection.
@@ -21,29 +35,300 @@ struct buffer
 	char *bytes;
 };
 
+struct event_loop;
+struct connection_data;
+
+/*
+ * One queued outgoing buffer. Requests are recycled per loop so steady state
+   async_write doesn't allocate at all.
+ * The same nodes are used as segments of segmented reads, so received chain may be queued
+   for writing without copying.
+ */
+struct write_request
+{
+	write_request *next;
+	bool notify;
+	buffer data;
+	// not NULL - request and its data live in malloc-ed block (send task), block is freed instead of reusing request
+	void *block;
+};
+
+/*
+ * Chain of fixed-size (SEGMENTLEN) segments. Reading big message only appends segments -
+   bytes are never moved, no matter how big message is.
+ */
+struct segment_chain
+{
+	write_request *head, *tail;
+	size_t size;
+};
+
+/*
+ * connection_id = loop (8 bits) | generation (24 bits) | slot index (32 bits).
+ * Generation is bumped every time slot is released so stale id never matches recycled slot.
+ */
+typedef uint64_t connection_id;
+
+// error != 0 means that accept failed (connection is NULL then)
+typedef std::function<void(int error, connection_data *)> t_accept_handler;
+typedef inline_function<void(int bytes_transferred, connection_data *)> t_read_handler;
+typedef inline_function<void(int bytes_transferred, connection_data *)> t_write_handler;
+// frame points to payload in connection buffer and is valid only during call; (NULL, 0, NULL) - connection closed
+typedef inline_function<void(const char *frame, size_t size, connection_data *)> t_frame_handler;
+typedef inline_function<void()> t_timer_handler;
+typedef inline_function<void()> t_post_handler;
+
+/*
+ * Completion handlers are kept per connection so different connections may run different
+   protocols at the same time.
+ * Connection is registered in epoll only once (on accept) for EPOLLIN | EPOLLOUT | EPOLLRDHUP
+   in edge-triggered mode. What caller wants (want_read/want_write) and what kernel reported
+   (readable/writable) is tracked here so async_read/async_write don't call epoll_ctl at all.
+*/
 struct connection_data
 {
+    connection_id id;
     int fd;
     uint32_t event;
 	buffer data;
+	event_loop *loop;
+	t_read_handler read_handler;
+	t_write_handler write_handler;
+	bool want_read, want_write;
+	bool readable, writable;
+	bool ready;
+	connection_data *next_ready;
+	// loop round in which connection used up its budget, it's not visited again before next round
+	uint64_t exhausted_round;
+	// outbound queue, flushed in order; want_write is set as long as queue is not empty
+	write_request *write_head, *write_tail;
+	// bytes of silent requests (queue_write) reported with next notifying one
+	size_t unreported_bytes;
+	// request given by prepare_write and not committed yet; queued means it's already write_tail
+	write_request *prepared;
+	bool prepared_queued;
+	// segmented reads fill segments instead of data
+	bool segmented;
+	segment_chain segments;
+	/*
+	 * io_uring backend only: bytes received by kernel before caller asked for them (readable means
+	   there is something here) and end of stream reported by kernel, delivered after those bytes.
+	 */
+	segment_chain inbound;
+	bool peer_closed;
+	/*
+	 * Read backpressure (bytes). One delivery never carries more than high watermark, the rest stays in
+	   kernel and TCP window pushes back on sender. io_uring receive (which runs ahead of async_read)
+	   is paused when inbound chain reaches high watermark and resumed when caller drains it
+	   to low watermark (receives completed before cancel took effect are still kept, so chain may
+	   exceed high watermark by what provided buffers hold).
+	 */
+	size_t read_high_watermark, read_low_watermark;
+	// io_uring only: multishot receive is in flight, receive is paused by high watermark
+	bool receiving, receive_paused;
+	// framed reads: data[start, size) holds bytes not consumed yet (partial frame)
+	frame_prefix framing;
+	size_t max_frame_size;
+	t_frame_handler frame_handler;
+	// peer ended stream of framed connection, it's closed when responses to last frames are written
+	bool close_when_written;
+	sockaddr_storage peer;
+	socklen_t peer_length;
+	// per connection stats, touched only by loop thread
+	size_t bytes_read, bytes_written, messages;
+	/*
+	 * Timeouts (ms, 0 - disabled) and deadlines derived from them (monotonic ms, 0 - none). One timer
+	   per connection is armed for the earliest deadline only when deadline moves earlier, so
+	   refreshing deadline on every message is only a store.
+	 */
+	uint32_t idle_timeout, read_timeout, write_timeout;
+	uint64_t last_activity, read_deadline, write_deadline;
+	timer_node timer;
+};
+
+/*
+ * Snapshot of lock-free counters kept per loop. All of them are totals since init, so rates
+   come from difference of two snapshots.
+ */
+struct transport_stats
+{
+	size_t epoll_ctl_calls;
+	// read handler calls or delivered frames
+	size_t messages;
+	// syscalls (read, sendmsg), so bytes / calls gives size per syscall
+	size_t write_calls, read_calls;
+	size_t bytes_read, bytes_written;
+	size_t read_eagains, write_eagains;
+	// reads stopped by high watermark while peer had more data
+	size_t read_pauses;
+	// visits cut by round budget (connection was revisited in next round)
+	size_t budget_exhausted;
+	// tasks from post/send which loop ran and wakeups which brought them
+	size_t posted_tasks, post_wakeups;
+	size_t reallocations;
+	// epoll_wait returns and events reported by them
+	size_t wakeups, events;
+	size_t accepted, rejected, active_connections;
+	size_t pool_bytes_in_use;
 };
 
-typedef std::function<void(int error, connection_data *,
-								const char *address, const char *port)> t_accept_handler;
-typedef std::function<void(int bytes_transferred, connection_data *)> t_read_handler;
-typedef std::function<void(int bytes_transferred, connection_data *)> t_write_handler;
+enum class io_backend
+{
+	epoll,
+	/*
+	 * Completion based loop: multishot accept, multishot receive into ring of provided buffers
+	   and sendmsg-s of all connections submitted together with wait for next completions - so
+	   steady state costs one io_uring_enter per loop iteration instead of syscall per read/write.
+	 */
+	io_uring
+};
 
-extern t_accept_handler global_accept_handler;
-extern t_read_handler global_read_handler;
-extern t_write_handler global_write_handler;
-extern int server_fd, epoll_fd;
-extern epoll_event *events;
+struct transport_options
+{
+	/*
+	 * Multi-reactor mode. Every loop has own epoll instance, own listener bound with SO_REUSEPORT
+	   (so kernel balances incoming connections between loops) and own memory_pool. Loop 0 is driven
+	   by thread which calls run(), rest of loops get own threads. With pin_loops loop i is pinned to core i.
+	 */
+	int loops_number = 1;
+	bool pin_loops = false;
+	// capacity of connection slab per loop, clients above limit are closed just after accept
+	uint32_t max_connections = 16384;
+	int listen_backlog = SOMAXCONN;
+	// every loop logs its stats (LOG_INFO) this often, 0 - never
+	int stats_interval_ms = 0;
+	// timeouts of every accepted connection (see set_timeouts), 0 - disabled
+	uint32_t idle_timeout_ms = 0;
+	uint32_t read_timeout_ms = 0;
+	uint32_t write_timeout_ms = 0;
+	// read watermarks of every accepted connection (see set_read_watermarks)
+	size_t read_high_watermark = MAXLEN;
+	size_t read_low_watermark = MAXLEN / 4;
+	/*
+	 * Fairness: in one loop round connection may read and write at most round_budget_bytes (each
+	   direction, at most round_budget_calls syscalls). Connection with more to do waits at the end
+	   of ready list for next round (loop doesn't sleep then), so one bulk sender doesn't delay
+	   everybody else until it hits EAGAIN.
+	 */
+	size_t round_budget_bytes = 256*1024;
+	int round_budget_calls = 16;
+	// io_uring falls back to epoll when kernel lacks support (see active_backend)
+	io_backend backend = io_backend::epoll;
+	// io_uring only: kernel thread polls submission ring, so submitting needs no syscall at all
+	bool sqpoll = false;
+};
 
 extern void init(int port);
+extern void init(int port, int loops_number, bool pin_loops);
+extern void init(int port, const transport_options &options);
 extern void run();
+// backend really used by loops (requested one or epoll fallback), valid after init
+extern io_backend active_backend();
+// no-op when run() has already returned
+extern void stop();
+// sums counters of all loops; after run() returns gives counters of last run
+extern transport_stats get_stats();
+// counters of one loop, may be called from any thread between init() and end of run()
+extern transport_stats get_loop_stats(int loop);
 extern void async_accept( t_accept_handler accept_handler );
+/*
+ * Hands connection->data over to caller (connection gets fresh buffer), e.g. for processing
+   on worker thread. Detached buffer is given back by release_buffer which may be called from any
+   thread - memory returns to pool of loop which allocated it without any lock.
+ */
+extern buffer detach_buffer(connection_data *connection);
+extern void release_buffer(buffer *data);
+// O(1) lookup, NULL if connection was closed (even if its slot is already reused)
+extern connection_data *find_connection(connection_id id);
+// formats peer host/port on demand (getnameinfo return code)
+extern int peer_address(const connection_data *connection, char *host, size_t host_size,
+						char *port, size_t port_size);
 extern void async_read(t_read_handler read_handler, connection_data *connection);
 extern void async_write(t_write_handler write_handler, connection_data *connection);
+// same as above but reuse handler already installed on connection
+extern void async_read(connection_data *connection);
+extern void async_write(connection_data *connection);
+// queues copy of bytes, connection->data is not touched
+extern void async_write(t_write_handler write_handler, connection_data *connection,
+						const char *bytes, size_t size);
+/*
+ * queues copy of bytes without completion notification (e.g. framing header queued before
+   payload passed to async_write). Everything queued is flushed together by one sendmsg.
+   Consecutive silent writes are appended to one buffer.
+ */
+extern void queue_write(connection_data *connection, const char *bytes, size_t size);
+/*
+ * Zero-copy queue_write. prepare_write gives buffer with at least size free bytes after data->size
+   (silent tail of queue when it has room, fresh request otherwise). Caller serializes directly
+   to data->bytes + data->size and commit_write appends first size bytes of that to queue.
+ * Calling prepare_write again before commit grows the same buffer (written bytes are kept but
+   bytes pointer may change), so message may have any size.
+ * Both calls must be done in one handler call and nothing else may be queued in between.
+ */
+extern buffer *prepare_write(connection_data *connection, size_t size);
+extern void commit_write(connection_data *connection, size_t size);
+
+/*
+ * Segmented reads: async_read fills connection->segments (previous chain is released first)
+   instead of growing and copying connection->data. contiguous_view copies segments into
+   connection->data only when consumer really needs contiguous memory. async_write_segments
+   moves whole chain to outbound queue without copying.
+ */
+extern void set_segmented_reads(connection_data *connection, bool enabled);
+
+/*
+ * Framing mode. Unlike async_read it stays armed: every complete frame which is in buffer after
+   read batch is delivered by separate frame_handler call (so one read may give many frames),
+   partial frame is kept for next read. Frame bigger than max_frame_size (or malformed prefix)
+   closes connection. connection->data belongs to transport in this mode so responses must be
+   queued by copying async_write/queue_write (or built in place by prepare_write). async_read
+   switches connection back to raw mode. When peer ends its stream, frames received before are
+   still delivered and connection is closed after responses queued for them are written.
+ */
+extern void async_read_frames(t_frame_handler frame_handler, connection_data *connection,
+							  frame_prefix prefix, size_t max_frame_size);
+extern const char *contiguous_view(connection_data *connection);
+extern void async_write_segments(connection_data *connection);
+
+/*
+ * Timeouts of connection (ms, 0 - disabled). Connection which misses deadline is closed and reported
+   as closed by peer - idle and read timeouts to read (or frame) handler, write timeout to write handler.
+ * idle: nothing was read or written for idle_ms
+ * read: caller waits in async_read / async_read_frames for read_ms and no bytes come
+ * write: queued data doesn't make any progress for write_ms (e.g. client which stopped reading)
+ */
+extern void set_timeouts(connection_data *connection, uint32_t idle_ms, uint32_t read_ms, uint32_t write_ms);
+
+/*
+ * Bounds memory which connection holds for bytes not consumed yet (0 < low <= high). Read handler
+   gets at most high bytes per call (framed connection: high bytes per read batch, partial frame
+   is kept on top of that), so reading big stream takes many calls instead of one huge buffer.
+ */
+extern void set_read_watermarks(connection_data *connection, size_t high, size_t low);
+
+/*
+ * Timer on loop of calling thread (handler runs on that loop), e.g. heartbeat. period_ms = 0 - one-shot,
+   handle is invalid after its handler started. Periodic timer runs until cancel_timer
+   (which may be called from its own handler).
+ */
+struct loop_timer;
+extern loop_timer *add_timer(uint32_t delay_ms, uint32_t period_ms, t_timer_handler handler);
+extern void cancel_timer(loop_timer *timer);
+
+/*
+ * Cross-thread API, may be called from any thread (e.g. worker which computed response) between
+   init() and end of run(). Task is pushed on lock-free queue of loop and eventfd of that loop
+   is signalled only when queue was empty, so burst of posts costs one wakeup. Tasks posted
+   by one thread run in order of posting.
+ * post: handler runs on given loop (connection_loop gives loop of connection).
+ * send: data[start, size) is queued to connection as silent write (like queue_write). Buffer is
+   taken over (it's released by transport, also when connection was closed meanwhile) and it's
+   not copied when it comes from pool of that loop (e.g. from detach_buffer). Buffer of any other
+   pool is copied and released before send returns, so e.g. worker thread may exit right after.
+ */
+extern void post(int loop, t_post_handler handler);
+extern void send(connection_id id, buffer *data);
+extern int connection_loop(connection_id id);
 
 
 #endif // CUSTOM_TRANSPORT_HPP
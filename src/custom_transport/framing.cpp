@@ -0,0 +1,75 @@
+#include <cassert>
+#include <cstdint>
+#include "framing.hpp"
+
+static size_t fixed_prefix_size(frame_prefix prefix)
+{
+	switch (prefix)
+	{
+		case frame_prefix::u8: return 1;
+		case frame_prefix::u16: return 2;
+		case frame_prefix::u32: return 4;
+		default: return 0;
+	}
+}
+
+int decode_frame_prefix(frame_prefix prefix, const char *bytes, size_t available, size_t *frame_size)
+{
+	const unsigned char *data = reinterpret_cast<const unsigned char *>(bytes);
+	assert(prefix != frame_prefix::none);
+
+	if (prefix == frame_prefix::varint)
+	{
+		size_t value = 0;
+		for (size_t i = 0; i < max_frame_prefix_size; i++)
+		{
+			if (i == available)
+				return 0;
+			value |= size_t(data[i] & 0x7f) << (7 * i);
+			if ((data[i] & 0x80) == 0)
+			{
+				*frame_size = value;
+				return i + 1;
+			}
+		}
+		return -1;
+	}
+
+	const size_t size = fixed_prefix_size(prefix);
+	if (available < size)
+		return 0;
+
+	size_t value = 0;
+	for (size_t i = 0; i < size; i++)
+		value |= size_t(data[i]) << (8 * i);
+	*frame_size = value;
+	return size;
+}
+
+size_t encode_frame_prefix(frame_prefix prefix, size_t frame_size, char *out)
+{
+	unsigned char *data = reinterpret_cast<unsigned char *>(out);
+	assert(prefix != frame_prefix::none);
+
+	if (prefix == frame_prefix::varint)
+	{
+		assert(frame_size <= UINT32_MAX);
+		size_t i = 0;
+		do
+		{
+			data[i] = frame_size & 0x7f;
+			frame_size >>= 7;
+			if (frame_size != 0)
+				data[i] |= 0x80;
+			i++;
+		}
+		while (frame_size != 0);
+		return i;
+	}
+
+	const size_t size = fixed_prefix_size(prefix);
+	assert(size == sizeof(size_t) || frame_size < (size_t(1) << (8 * size)));
+	for (size_t i = 0; i < size; i++)
+		data[i] = (frame_size >> (8 * i)) & 0xff;
+	return size;
+}
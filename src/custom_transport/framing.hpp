@@ -0,0 +1,31 @@
+#ifndef FRAMING_HPP
+#define FRAMING_HPP
+
+#include <cstddef>
+
+/*
+ * Length prefix of frame. Fixed size prefixes are little-endian (like ints put by
+   serialization::byte_buffer), varint is unsigned LEB128 (7 bits per byte, up to 5 bytes).
+ * Prefix carries size of payload only (prefix itself is not included).
+*/
+enum class frame_prefix
+{
+	none,
+	u8,
+	u16,
+	u32,
+	varint
+};
+
+constexpr static size_t max_frame_prefix_size = 5;
+
+/*
+ * Returns size of prefix and sets frame_size, 0 if there is not enough bytes yet,
+   -1 if prefix is malformed (varint longer than 5 bytes).
+ */
+extern int decode_frame_prefix(frame_prefix prefix, const char *bytes, size_t available,
+							   size_t *frame_size);
+// writes prefix for frame_size B payload to out (at least max_frame_prefix_size B), returns its size
+extern size_t encode_frame_prefix(frame_prefix prefix, size_t frame_size, char *out);
+
+#endif // FRAMING_HPP
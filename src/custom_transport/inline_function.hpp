@@ -0,0 +1,77 @@
+#ifndef INLINE_FUNCTION_HPP
+#define INLINE_FUNCTION_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/*
+ * inline_function is small, non-allocating replacement of std::function for completion handlers.
+ * Callable is stored in place (Capacity bytes) so installing handler on every async_read/async_write
+   is just copy of few words - no heap allocation like for std::function with big captured binder.
+ * Only trivially copyable and trivially destructible callables are accepted (function pointers,
+   my_boost::binder, lambdas capturing pointers/ints). Thanks to that copy is memcpy and
+   overwriting handler from inside of running handler is harmless.
+*/
+
+template<class Signature, size_t Capacity = 4 * sizeof(void*)>
+class inline_function;
+
+template<class R, class... Args, size_t Capacity>
+class inline_function<R(Args...), Capacity>
+{
+public:
+
+	inline_function() : invoker(nullptr) {}
+
+	inline_function(std::nullptr_t) : invoker(nullptr) {}
+
+	template<class F, class = typename std::enable_if<
+				 !std::is_same<typename std::decay<F>::type, inline_function>::value>::type>
+	inline_function(F callable)
+	{
+		static_assert(sizeof(F) <= Capacity, "callable is too big for inline_function");
+		static_assert(alignof(F) <= alignof(std::max_align_t), "callable is overaligned");
+		static_assert(std::is_trivially_copyable<F>::value &&
+					  std::is_trivially_destructible<F>::value,
+					  "inline_function accepts only trivially copyable callables");
+		new (&storage) F(callable);
+		invoker = &invoke<F>;
+	}
+
+	R operator()(Args... args) const
+	{
+		return invoker(&storage, std::forward<Args>(args)...);
+	}
+
+	explicit operator bool() const
+	{
+		return invoker != nullptr;
+	}
+
+	bool operator==(std::nullptr_t) const
+	{
+		return invoker == nullptr;
+	}
+
+	bool operator!=(std::nullptr_t) const
+	{
+		return invoker != nullptr;
+	}
+
+private:
+
+	template<class F>
+	static R invoke(const void *storage, Args... args)
+	{
+		F &callable = *const_cast<F*>(static_cast<const F*>(storage));
+		return callable(std::forward<Args>(args)...);
+	}
+
+	typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type storage;
+	R (*invoker)(const void *, Args...);
+};
+
+#endif // INLINE_FUNCTION_HPP
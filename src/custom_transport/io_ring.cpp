@@ -0,0 +1,323 @@
+#include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "io_ring.hpp"
+
+/*
+ * Head/tail words are shared with kernel: our side publishes with release store and reads kernel
+   side with acquire load (the same what liburing does).
+ */
+static unsigned load_acquire(const unsigned *word)
+{
+	return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(unsigned *word, unsigned value)
+{
+	__atomic_store_n(word, value, __ATOMIC_RELEASE);
+}
+
+int setup_io_ring(io_ring *ring, unsigned entries, unsigned completions, bool sqpoll)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = completions;
+	if (sqpoll)
+	{
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = 100; // ms
+	}
+
+	int fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0)
+		return -errno;
+	ring->fd = fd;
+	ring->sqpoll = sqpoll;
+
+	// older kernels need separate mappings, drop instead of overflow or have no timeout in io_uring_enter
+	const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	if ((params.features & required) != required)
+	{
+		destroy_io_ring(ring);
+		return -ENOSYS;
+	}
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (ring->cq_ring_size > ring->sq_ring_size)
+		ring->sq_ring_size = ring->cq_ring_size;
+	ring->cq_ring_size = ring->sq_ring_size;
+
+	void *rings = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					   fd, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED)
+	{
+		const int error = -errno;
+		destroy_io_ring(ring);
+		return error;
+	}
+	ring->sq_ring = ring->cq_ring = rings;
+
+	ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	void *sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					  fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		const int error = -errno;
+		destroy_io_ring(ring);
+		return error;
+	}
+	ring->sqes = (io_uring_sqe *) sqes;
+
+	char *base = (char *) rings;
+	ring->sq_head = (unsigned *) (base + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (base + params.sq_off.tail);
+	ring->sq_flags = (unsigned *) (base + params.sq_off.flags);
+	ring->sq_array = (unsigned *) (base + params.sq_off.array);
+	ring->sq_mask = *(unsigned *) (base + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->cq_head = (unsigned *) (base + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (base + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *) (base + params.cq_off.ring_mask);
+	ring->cqes = (io_uring_cqe *) (base + params.cq_off.cqes);
+	ring->sqe_tail = ring->sqe_submitted = *ring->sq_tail;
+	return 0;
+}
+
+/*
+ * Entries are indexed from beginning of ring and not by bufs - in C++ flexible array member of
+   kernel header ends up after empty struct (at offset 8) instead of overlaying tail.
+ */
+static void add_provided_buffer(io_ring *ring, unsigned id)
+{
+	io_uring_buf *entries = (io_uring_buf *) ring->buffers;
+	io_uring_buf *entry = &entries[ring->buffers_tail & (ring->buffers_number - 1)];
+	entry->addr = (uint64_t) (ring->buffer_bytes + size_t(id) * ring->buffer_size);
+	entry->len = ring->buffer_size;
+	entry->bid = id;
+	ring->buffers_tail++;
+}
+
+static void publish_provided_buffers(io_ring *ring)
+{
+	__atomic_store_n(&ring->buffers->tail, ring->buffers_tail, __ATOMIC_RELEASE);
+}
+
+int setup_provided_buffers(io_ring *ring, unsigned number, unsigned size)
+{
+	assert(ring->fd >= 0 && ring->buffers == NULL);
+	assert(number > 0 && number <= 32768 && (number & (number - 1)) == 0);
+
+	// buffer ring has to be page aligned, so it's mapped instead of allocated
+	ring->buffers_size = number * sizeof(io_uring_buf);
+	void *entries = mmap(NULL, ring->buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (entries == MAP_FAILED)
+		return -errno;
+	void *bytes = mmap(NULL, size_t(number) * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bytes == MAP_FAILED)
+	{
+		const int error = -errno;
+		munmap(entries, ring->buffers_size);
+		return error;
+	}
+
+	io_uring_buf_reg registration;
+	memset(&registration, 0, sizeof(registration));
+	registration.ring_addr = (uint64_t) entries;
+	registration.ring_entries = number;
+	registration.bgid = 0;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+	{
+		const int error = -errno;
+		munmap(entries, ring->buffers_size);
+		munmap(bytes, size_t(number) * size);
+		return error;
+	}
+
+	ring->buffers = (io_uring_buf_ring *) entries;
+	ring->buffer_bytes = (char *) bytes;
+	ring->buffers_number = number;
+	ring->buffer_size = size;
+	ring->buffers_tail = 0;
+	for (unsigned id = 0; id < number; id++)
+		add_provided_buffer(ring, id);
+	publish_provided_buffers(ring);
+	return 0;
+}
+
+void destroy_io_ring(io_ring *ring)
+{
+	if (ring->buffers != NULL)
+	{
+		io_uring_buf_reg registration;
+		memset(&registration, 0, sizeof(registration));
+		registration.bgid = 0;
+		syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+	}
+	if (ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->sq_ring != NULL)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	// ring is gone so kernel won't write to buffers anymore
+	if (ring->buffers != NULL)
+	{
+		munmap(ring->buffers, ring->buffers_size);
+		munmap(ring->buffer_bytes, size_t(ring->buffers_number) * ring->buffer_size);
+	}
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+static int enter(io_ring *ring, unsigned wait_number, unsigned flags, int timeout_ms)
+{
+	store_release(ring->sq_tail, ring->sqe_tail);
+	unsigned submit = ring->sqe_tail - ring->sqe_submitted;
+	if (ring->sqpoll)
+	{
+		// kernel thread picks SQEs itself, syscall only wakes it up when it went idle
+		ring->sqe_submitted = ring->sqe_tail;
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		else
+			if (submit > 0 && wait_number == 0 && !(flags & IORING_ENTER_SQ_WAIT))
+				return 0;
+	}
+	if (wait_number > 0)
+		flags |= IORING_ENTER_GETEVENTS;
+	if (submit == 0 && flags == 0)
+		return 0;
+
+	__kernel_timespec timeout;
+	io_uring_getevents_arg argument;
+	memset(&argument, 0, sizeof(argument));
+	argument.sigmask_sz = _NSIG / 8;
+	if (timeout_ms >= 0)
+	{
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		argument.ts = (uint64_t) &timeout;
+	}
+
+	int result = syscall(__NR_io_uring_enter, ring->fd, submit, wait_number,
+						 flags | IORING_ENTER_EXT_ARG, &argument, sizeof(argument));
+	if (result < 0)
+		return -errno;
+	if (!ring->sqpoll)
+		ring->sqe_submitted += result;
+	return 0;
+}
+
+io_uring_sqe *get_sqe(io_ring *ring, uint8_t opcode, int fd, uint64_t user_data)
+{
+	while (ring->sqe_tail - load_acquire(ring->sq_head) >= ring->sq_entries)
+	{
+		int return_code = enter(ring, 0, ring->sqpoll? IORING_ENTER_SQ_WAIT : 0, -1);
+		assert(return_code == 0 || return_code == -EINTR);
+		(void)return_code;
+	}
+
+	const unsigned index = ring->sqe_tail & ring->sq_mask;
+	io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+	ring->sqe_tail++;
+	return sqe;
+}
+
+int submit_and_wait(io_ring *ring, int timeout_ms)
+{
+	const bool ready = load_acquire(ring->cq_tail) != *ring->cq_head;
+	return enter(ring, ready? 0 : 1, 0, timeout_ms);
+}
+
+void submit_queued(io_ring *ring)
+{
+	if (ring->sqe_tail == load_acquire(ring->sq_head))
+		return;
+
+	int return_code = enter(ring, 0, 0, -1);
+	assert(return_code == 0 || return_code == -EINTR);
+	// kernel thread takes SQEs asynchronously, it's woken up again if it went idle meanwhile
+	while (ring->sqpoll && load_acquire(ring->sq_head) != ring->sqe_tail)
+	{
+		sched_yield();
+		return_code = enter(ring, 0, 0, -1);
+		assert(return_code == 0 || return_code == -EINTR);
+	}
+	(void)return_code;
+}
+
+io_uring_cqe *peek_cqe(io_ring *ring)
+{
+	const unsigned head = *ring->cq_head;
+	if (head == load_acquire(ring->cq_tail))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void advance_cqe(io_ring *ring)
+{
+	store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+const char *provided_buffer(const io_ring *ring, unsigned id)
+{
+	assert(id < ring->buffers_number);
+	return ring->buffer_bytes + size_t(id) * ring->buffer_size;
+}
+
+void recycle_provided_buffer(io_ring *ring, unsigned id)
+{
+	assert(id < ring->buffers_number);
+	add_provided_buffer(ring, id);
+	publish_provided_buffers(ring);
+}
+
+bool io_ring_supported()
+{
+	io_ring ring;
+	if (setup_io_ring(&ring, 4, 8, false) < 0)
+		return false;
+
+	bool supported = false;
+	int sockets[2];
+	if (setup_provided_buffers(&ring, 2, 64) == 0 &&
+		socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) == 0)
+	{
+		const char byte = 1;
+		if (write(sockets[1], &byte, 1) == 1)
+		{
+			io_uring_sqe *sqe = get_sqe(&ring, IORING_OP_RECV, sockets[0], 1);
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = 0;
+			if (submit_and_wait(&ring, 1000) == 0)
+			{
+				const io_uring_cqe *cqe = peek_cqe(&ring);
+				supported = cqe != NULL && cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) &&
+						(cqe->flags & IORING_CQE_F_MORE);
+			}
+		}
+		close(sockets[0]);
+		close(sockets[1]);
+	}
+	destroy_io_ring(&ring);
+	return supported;
+}
@@ -0,0 +1,79 @@
+#ifndef IO_RING_HPP
+#define IO_RING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper on raw syscalls (no liburing): submission/completion rings mapped
+   into process and one ring of provided buffers (buffer group 0) for multishot receives.
+ * Ring is not thread-safe, every event loop has own one.
+ * SQEs taken by get_sqe are only queued in memory, all of them go to kernel together with next
+   submit_and_wait - so sends produced by whole batch of handlers cost one io_uring_enter which
+   also waits for next completions.
+ * With sqpoll kernel thread takes SQEs itself and io_uring_enter is needed only to wake it up
+   (after idle period) or to sleep for completions.
+ */
+struct io_ring
+{
+	int fd;
+	bool sqpoll;
+	// submission ring
+	unsigned *sq_head, *sq_tail, *sq_flags, *sq_array;
+	unsigned sq_mask, sq_entries;
+	io_uring_sqe *sqes;
+	// next free SQE and first one not passed to kernel yet
+	unsigned sqe_tail, sqe_submitted;
+	// completion ring
+	unsigned *cq_head, *cq_tail;
+	unsigned cq_mask;
+	io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	// provided buffers
+	io_uring_buf_ring *buffers;
+	size_t buffers_size;
+	char *buffer_bytes;
+	unsigned buffers_number, buffer_size;
+	uint16_t buffers_tail;
+};
+
+// 0 or -errno
+extern int setup_io_ring(io_ring *ring, unsigned entries, unsigned completions, bool sqpoll);
+extern int setup_provided_buffers(io_ring *ring, unsigned number, unsigned size);
+// kernel cancels everything what is in flight, provided buffers are released after that
+extern void destroy_io_ring(io_ring *ring);
+/*
+ * Never NULL - when submission ring is full queued SQEs are submitted first.
+ * SQE is zeroed except of opcode, fd and user_data.
+ */
+extern io_uring_sqe *get_sqe(io_ring *ring, uint8_t opcode, int fd, uint64_t user_data);
+/*
+ * Submits queued SQEs and waits up to timeout_ms (-1 - forever) for at least one completion.
+   Doesn't wait at all when completions are already there.
+ * Returns 0 or -errno (-EINTR signal, -ETIME timeout).
+ */
+extern int submit_and_wait(io_ring *ring, int timeout_ms);
+/*
+ * Submits queued SQEs without waiting for completions. When it returns kernel has taken all of
+   them (with sqpoll too), so descriptors they refer to by number may be closed.
+ */
+extern void submit_queued(io_ring *ring);
+// NULL when completion ring is empty, otherwise cqe has to be released by advance_cqe
+extern io_uring_cqe *peek_cqe(io_ring *ring);
+extern void advance_cqe(io_ring *ring);
+extern const char *provided_buffer(const io_ring *ring, unsigned id);
+// buffer content was consumed, kernel may fill it again
+extern void recycle_provided_buffer(io_ring *ring, unsigned id);
+/*
+ * Checks whether kernel supports everything what io_uring backend needs (ring with external
+   timeout argument, provided buffer rings, multishot receive) by receiving one byte
+   over socketpair.
+ */
+extern bool io_ring_supported();
+
+#endif // IO_RING_HPP
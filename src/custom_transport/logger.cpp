@@ -1,17 +1,42 @@
 #include <chrono>
 #include <cassert>
+#include <cerrno>
 #include <cstdarg>
 #include <thread>
 #include <ctime>
+#include <algorithm>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "logger.hpp"
 
 namespace framework
 {
 
+namespace
+{
+	// ring of current thread is marked as closed when thread ends, writer frees it after draining
+	struct ring_owner
+	{
+		~ring_owner()
+		{
+			if (ring != nullptr)
+				ring->closed.store(true, std::memory_order_release);
+		}
+
+		async_log::ring *ring = nullptr;
+	};
+
+	thread_local ring_owner current_ring;
+	const size_t batch_size = 64 * 1024;
+}
+
 logger::logger(bool enabled, bool log_to_file, bool log_date, bool log_in_place)
 	: on(enabled), write_to_file(log_to_file), write_date(log_date), in_place(log_in_place)
 {
+	writer_wakeup_fd = eventfd(0, EFD_CLOEXEC);
+	assert(writer_wakeup_fd >= 0);
 	if (on && write_to_file)
 	{
 		file_proxy = fopen ("log.txt", "w");
@@ -20,7 +45,7 @@ logger::logger(bool enabled, bool log_to_file, bool log_date, bool log_in_place)
 }
 
 // TO DO: lock may be much relaxed probably (maybe even to put_time_in_buffer)
-void logger::log(const char *string, ...)
+void logger::log_sync(const char *string, ...)
 {
 	std::lock_guard<std::mutex> lock(mutex);
 
@@ -90,35 +115,256 @@ void logger::log(const char *string, ...)
 
  void logger::enable(bool enabled)
  {
-	 std::lock_guard<std::mutex> lock(mutex);
-	 on = enabled;
+	 on.store(enabled, std::memory_order_relaxed);
  }
 
+void logger::set_async(bool enabled)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (enabled == writer_running.load(std::memory_order_relaxed))
+		return;
+
+	if (enabled)
+	{
+		// writer inherits blocked signals so they are still delivered to application threads
+		sigset_t blocked, previous;
+		sigfillset(&blocked);
+		pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+		writer_running.store(true, std::memory_order_release);
+		writer = std::thread(&logger::run_writer, this);
+		pthread_sigmask(SIG_SETMASK, &previous, NULL);
+		async.store(true, std::memory_order_release);
+	}
+	else
+	{
+		async.store(false, std::memory_order_release);
+		writer_running.store(false, std::memory_order_release);
+		const uint64_t wakeup = 1;
+		int return_code = write(writer_wakeup_fd, &wakeup, sizeof(wakeup));
+		assert(return_code == sizeof(wakeup));
+		(void)return_code;
+		writer.join();
+		// records committed after last drain of writer (producer saw async just before it was cleared)
+		drain_remaining();
+	}
+}
+
 logger::~logger()
 {
+	set_async(false);
+	drain_remaining();
+	close(writer_wakeup_fd);
+	while (rings != nullptr)
+	{
+		async_log::ring *ring = rings;
+		rings = ring->next;
+		delete ring;
+	}
 	if (opened)
 	{
 		fclose (file_proxy);
 	}
 }
 
+async_log::ring *logger::thread_ring()
+{
+	if (current_ring.ring == nullptr)
+	{
+		async_log::ring *ring = new async_log::ring;
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		ring->next = rings;
+		rings = ring;
+		current_ring.ring = ring;
+	}
+	return current_ring.ring;
+}
+
+/*
+ * Record is always contiguous. If it doesn't fit before end of ring, rest of ring is published
+   as padding (header with NULL format or just too small space for header) and record starts at 0.
+ */
+unsigned char *logger::reserve_record(size_t size)
+{
+	using async_log::ring;
+	ring *current = thread_ring();
+	size_t head = current->head.load(std::memory_order_relaxed);
+	const size_t tail = current->tail.load(std::memory_order_acquire);
+	const size_t left = ring::capacity - head % ring::capacity;
+	const size_t needed = (left < size)? left + size : size;
+
+	if (size > ring::capacity / 4 || ring::capacity - (head - tail) < needed)
+	{
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	if (left < size)
+	{
+		if (left >= sizeof(async_log::record))
+			reinterpret_cast<async_log::record *>(&current->bytes[head % ring::capacity])->format = nullptr;
+		head += left;
+	}
+	return &current->bytes[head % ring::capacity];
+}
+
+/*
+ * Padding (if any) is published together with record. Writer is woken up only when ring was
+   empty - tail is read after head is stored and writer reads heads after it stores tails, so
+   (seq_cst) either writer sees this record before it goes to sleep or producer sees empty ring.
+ */
+void logger::commit_record(size_t size)
+{
+	using async_log::ring;
+	ring *current = current_ring.ring;
+	const size_t head = current->head.load(std::memory_order_relaxed);
+	const size_t left = ring::capacity - head % ring::capacity;
+	const size_t end = head + ((left < size)? left : 0) + size;
+	current->head.store(end, std::memory_order_seq_cst);
+
+	if (current->tail.load(std::memory_order_seq_cst) == head)
+	{
+		const uint64_t wakeup = 1;
+		int return_code = write(writer_wakeup_fd, &wakeup, sizeof(wakeup));
+		assert(return_code == sizeof(wakeup));
+		(void)return_code;
+	}
+}
+
+void logger::write_batch(const char *batch, size_t size)
+{
+	if (write_to_file)
+		fwrite(batch, 1, size, file_proxy);
+	else
+		fwrite(batch, 1, size, stdout);
+}
+
+// formats "[HH:MM:SS::ms] " + line + '\n', returns number of bytes
+size_t logger::format_record(const async_log::record *record, char *out)
+{
+	size_t written = 0;
+	if (write_date)
+	{
+		if (record->time.tv_sec != formatted_second)
+		{
+			tm local;
+			localtime_r(&record->time.tv_sec, &local);
+			strftime(formatted_time, sizeof formatted_time, "%H:%M:%S", &local);
+			formatted_second = record->time.tv_sec;
+		}
+		written = sprintf(out, "[%s::%d] ", formatted_time, int(record->time.tv_nsec / 1000000L));
+	}
+
+	const unsigned char *arguments = reinterpret_cast<const unsigned char *>(record + 1);
+	int return_code = record->format(out + written, max_line_size, record->string, arguments);
+	assert(return_code >= 0);
+	written += std::min(size_t(return_code), size_t(max_line_size - 1));
+	out[written++] = '\n';
+	return written;
+}
+
+// returns true if any record was written
+bool logger::drain_rings(char *batch)
+{
+	using async_log::ring;
+	const size_t max_record_line = 64 + max_line_size;
+	size_t used = 0;
+	bool any = false;
+
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	ring **link = &rings;
+	while (*link != nullptr)
+	{
+		ring *current = *link;
+		// closed is checked before head so everything what owner logged is visible
+		const bool closed = current->closed.load(std::memory_order_acquire);
+		const size_t head = current->head.load(std::memory_order_seq_cst);
+		size_t tail = current->tail.load(std::memory_order_relaxed);
+		any = any || (tail != head);
+
+		while (tail != head)
+		{
+			const size_t left = ring::capacity - tail % ring::capacity;
+			const async_log::record *record = reinterpret_cast<const async_log::record *>(
+						&current->bytes[tail % ring::capacity]);
+			if (left < sizeof(async_log::record) || record->format == nullptr)
+			{
+				tail += left;
+				continue;
+			}
+
+			if (batch_size - used < max_record_line)
+			{
+				write_batch(batch, used);
+				used = 0;
+			}
+			used += format_record(record, batch + used);
+			tail += record->size;
+		}
+		current->tail.store(tail, std::memory_order_seq_cst);
+
+		if (closed)
+		{
+			*link = current->next;
+			delete current;
+		}
+		else
+			link = &current->next;
+	}
+
+	const size_t dropped_records = dropped.exchange(0, std::memory_order_relaxed);
+	if (dropped_records > 0 && batch_size - used < max_record_line)
+	{
+		write_batch(batch, used);
+		used = 0;
+	}
+	if (dropped_records > 0)
+		used += sprintf(batch + used, "logger: %zu records were dropped\n", dropped_records);
+
+	if (used > 0)
+	{
+		write_batch(batch, used);
+		fflush(write_to_file? file_proxy : stdout);
+	}
+	return any;
+}
+
+// writer is stopped already (or wasn't running), so caller formats with its own batch
+void logger::drain_remaining()
+{
+	char *batch = new char[batch_size];
+	drain_rings(batch);
+	delete[] batch;
+}
+
+// sleeps only after drain which found nothing, signal which came meanwhile stays in eventfd counter
+void logger::run_writer()
+{
+	char *batch = new char[batch_size];
+	while (writer_running.load(std::memory_order_acquire))
+	{
+		if (drain_rings(batch))
+			continue;
+		uint64_t wakeups;
+		int return_code = read(writer_wakeup_fd, &wakeups, sizeof(wakeups));
+		assert(return_code == sizeof(wakeups) || (return_code == -1 && errno == EINTR));
+		(void)return_code;
+	}
+	delete[] batch;
+}
+
+// prefix is formatted by cached_clock at most once per second
 char *logger::put_time_in_buffer()
 {
-	auto current_time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+	const cached_time &time = cached_clock();
 
 	int current = 0;
 	buffer[current++] = '[';
 
-	size_t written_bytes = strftime(&buffer[current], 20, "%H:%M:%S", localtime( &current_time ));
-	assert(written_bytes > 0);
+	size_t written_bytes = strlen(time.prefix);
+	memcpy(&buffer[current], time.prefix, written_bytes);
 	current += written_bytes;
 
-	struct timespec ts;
-
-	int result = clock_gettime( CLOCK_REALTIME, &ts);
-	assert(result == 0);
-
-	int ms = ts.tv_nsec / 1000000L;
+	int ms = time.now.tv_nsec / 1000000L;
 
 	written_bytes = sprintf(&buffer[current], "::%d", ms);
 	assert(written_bytes > 0);
@@ -2,11 +2,155 @@
 #define LOGGER_HPP
 
 #include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <atomic>
 #include <mutex>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "cached_clock.hpp"
 
 namespace framework
 {
 
+/*
+ * Asynchronous mode. log only puts compact binary record (format pointer, timestamp, arguments
+   by value, %s strings copied) into ring of calling thread and returns. Background thread formats
+   records and writes them to file in batches with one fflush per batch, so I/O thread never
+   touches disk, mutex or localtime. Timestamp is taken from cached_clock of calling thread.
+ * Every thread has own single producer/single consumer ring, so producer needs only two atomic
+   loads and one store (and one more load to find out if ring was empty). Idle writer sleeps on
+   eventfd which is signalled only by record put into empty ring. Record which doesn't fit
+   (consumer too slow) is dropped and counted - logging never blocks. Lines from one thread keep order, lines from different threads are
+   written ring after ring.
+ * Format string must be literal (only pointer is kept).
+ */
+namespace async_log
+{
+	typedef int (*format_function)(char *out, size_t size, const char *format, const unsigned char *arguments);
+
+	struct record
+	{
+		uint32_t size; // with arguments, multiple of 8
+		format_function format; // NULL - padding to end of ring
+		const char *string;
+		timespec time;
+	};
+
+	struct ring
+	{
+		const static size_t capacity = 64 * 1024;
+		std::atomic<size_t> head {0}; // written by producer
+		std::atomic<size_t> tail {0}; // written by consumer
+		std::atomic<bool> closed {false}; // owner thread is gone
+		ring *next = nullptr;
+		alignas(8) unsigned char bytes[capacity];
+	};
+
+	// %s argument is copied to record, everything else is stored by value
+	template<class T>
+	struct argument
+	{
+		static_assert(std::is_arithmetic<T>::value || std::is_pointer<T>::value || std::is_enum<T>::value,
+					  "only scalar log arguments are supported");
+		typedef T type;
+
+		static size_t size(T)
+		{
+			return sizeof(T);
+		}
+
+		static unsigned char *write(unsigned char *out, T value)
+		{
+			memcpy(out, &value, sizeof(value));
+			return out + sizeof(value);
+		}
+
+		static T read(const unsigned char *&in)
+		{
+			T value;
+			memcpy(&value, in, sizeof(value));
+			in += sizeof(value);
+			return value;
+		}
+	};
+
+	template<>
+	struct argument<const char *>
+	{
+		typedef const char *type;
+
+		// NULL is stored as text printed for it by synchronous (glibc vsnprintf) path
+		static const char *text(const char *value)
+		{
+			return (value != nullptr)? value : "(null)";
+		}
+
+		static size_t size(const char *value)
+		{
+			return strlen(text(value)) + 1;
+		}
+
+		static unsigned char *write(unsigned char *out, const char *value)
+		{
+			const size_t length = strlen(text(value)) + 1;
+			memcpy(out, text(value), length);
+			return out + length;
+		}
+
+		static const char *read(const unsigned char *&in)
+		{
+			const char *value = reinterpret_cast<const char *>(in);
+			in += strlen(value) + 1;
+			return value;
+		}
+	};
+
+	template<>
+	struct argument<char *> : argument<const char *>
+	{
+	};
+
+	template<class... Args>
+	struct arguments
+	{
+		static size_t size(Args... args)
+		{
+			const size_t sizes[] = {0, argument<Args>::size(args)...};
+			size_t result = 0;
+			for (size_t size : sizes)
+				result += size;
+			return result;
+		}
+
+		static void write(unsigned char *out, Args... args)
+		{
+			const int expand[] = {0, (out = argument<Args>::write(out, args), 0)...};
+			(void)expand;
+			(void)out;
+		}
+
+		template<size_t... I>
+		static int format(char *out, size_t size, const char *format,
+						  const std::tuple<typename argument<Args>::type...> &values, std::index_sequence<I...>)
+		{
+			return snprintf(out, size, format, std::get<I>(values)...);
+		}
+
+		static int format(char *out, size_t size, const char *format, const unsigned char *in)
+		{
+			// braced initialization reads arguments left to right
+			const std::tuple<typename argument<Args>::type...> values {argument<Args>::read(in)...};
+			(void)in;
+			return arguments::format(out, size, format, values, std::index_sequence_for<Args...>());
+		}
+	};
+}
+
 /* logger is singleton so protection is needed only in log method */
 class logger
 {
@@ -18,9 +162,36 @@ public:
 		return instance;
 	}
 
-	void log(const char *string, ...);
+	template<class... Args>
+	void log(const char *string, Args... args)
+	{
+		if (!on.load(std::memory_order_relaxed))
+			return;
+		if (async.load(std::memory_order_relaxed))
+			log_async(string, args...);
+		else
+			log_sync(string, args...);
+	}
+
+	// runtime part of leveled logging (LOG_* macros), no lock
+	bool enabled(int level) const
+	{
+		return on.load(std::memory_order_relaxed) && level >= min_level.load(std::memory_order_relaxed);
+	}
+
+	void set_level(int level)
+	{
+		min_level.store(level, std::memory_order_relaxed);
+	}
+
+	void log_sync(const char *string, ...);
 	void log_in_place(const char *string, ...);
 	void enable(bool enabled);
+	/*
+	 * Starts/stops background writer. Stopping (also in destructor) waits until all rings are
+	   drained, so nothing logged before is lost.
+	 */
+	void set_async(bool enabled);
 
 private:
 
@@ -34,9 +205,38 @@ private:
 
 	~logger();
 
+	template<class... Args>
+	void log_async(const char *string, Args... args)
+	{
+		typedef async_log::arguments<Args...> arguments;
+		const size_t size = (sizeof(async_log::record) + arguments::size(args...) + 7) & ~size_t(7);
+		unsigned char *out = reserve_record(size);
+		if (out == nullptr)
+			return;
+
+		async_log::record *header = reinterpret_cast<async_log::record *>(out);
+		header->size = size;
+		header->format = &arguments::format;
+		header->string = string;
+		header->time = cached_clock().now;
+		arguments::write(out + sizeof(async_log::record), args...);
+		commit_record(size);
+	}
+
+	// NULL if record doesn't fit into ring of current thread
+	unsigned char *reserve_record(size_t size);
+	void commit_record(size_t size);
+	async_log::ring *thread_ring();
+	size_t format_record(const async_log::record *record, char *out);
+	void write_batch(const char *batch, size_t size);
+	bool drain_rings(char *batch);
+	void drain_remaining();
+	void run_writer();
+
 	char *put_time_in_buffer();
 
-	bool on;
+	std::atomic<bool> on;
+	std::atomic<int> min_level {0};
 	const bool write_to_file, write_date;
 	bool opened {false};
 	bool in_place;
@@ -44,10 +244,50 @@ private:
 	char buffer[max_line_size];
 	FILE * file_proxy = nullptr;
 	std::mutex mutex;
+
+	std::atomic<bool> async {false};
+	std::atomic<bool> writer_running {false};
+	std::atomic<size_t> dropped {0};
+	std::thread writer;
+	// lives as long as logger, so late producer never signals closed (or reused) descriptor
+	int writer_wakeup_fd = -1;
+	// rings registration (once per thread) and draining are protected by rings_mutex
+	std::mutex rings_mutex;
+	async_log::ring *rings = nullptr;
+	// used only by writer thread (and by thread which stopped it)
+	time_t formatted_second = 0;
+	char formatted_time[16];
 };
 
 }
 
 #define logger_ framework::logger::get()
 
+/*
+ * Leveled logging. Calls below compile-time LOG_LEVEL (e.g. -DLOG_LEVEL=2 in release Makefiles)
+   are removed by compiler together with evaluation of arguments, so per-message debug logs may
+   stay in source. Remaining levels are checked at runtime by logger_.set_level without any lock.
+ */
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_TRACE
+#endif
+
+#define LOG_AT(level, ...) \
+	do { \
+		if ((level) >= LOG_LEVEL && logger_.enabled(level)) \
+			logger_.log(__VA_ARGS__); \
+	} while (0)
+
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
 #endif // LOGGER_HPP
@@ -1,12 +1,30 @@
+
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <cstdint>
 #include "memory_pool.hpp"
 
+static_assert(max_small_size < sizeof(small_chunk::bytes) / 2, "small chunk must hold few biggest blocks");
+static_assert(sizeof(small_chunk) == page_size, "small chunk must fill exactly one page");
+static_assert(sizeof(free_block) <= (size_t(1) << min_size_class_shift), "free_block must fit in smallest class");
+
+static thread_local memory_pool *local_pool = NULL;
+
 void init_pool(memory_pool *pool)
 {
 	pool->big_list = NULL;
 	pool->small_list = NULL;
+	for (int i = 0; i < size_classes_number; i++)
+		pool->free_lists[i] = NULL;
+	pool->remote_frees.store(NULL, std::memory_order_relaxed);
+	pool->bytes_in_use.store(0, std::memory_order_relaxed);
+}
+
+static void account(memory_pool *pool, size_t added, size_t removed)
+{
+	pool->bytes_in_use.store(pool->bytes_in_use.load(std::memory_order_relaxed) + added - removed,
+							 std::memory_order_relaxed);
 }
 
 void destroy_pool(memory_pool *pool)
@@ -27,56 +45,97 @@ void destroy_pool(memory_pool *pool)
 		pool->big_list = pool->big_list->next;
 		free(previous_big);
 	}
+
+	for (int i = 0; i < size_classes_number; i++)
+		pool->free_lists[i] = NULL;
+	pool->remote_frees.store(NULL, std::memory_order_relaxed);
+}
+
+static big_chunk *chunk_of(void *ptr)
+{
+	return (big_chunk *) ((char *)ptr - offsetof(big_chunk, bytes));
 }
 
+// ptr is address returned by allocate for big request
 bool destroy_chunk(memory_pool *pool, void *ptr)
 {
-	big_chunk *previous_big = NULL;
-	big_chunk *current_big = pool->big_list;
-	while (current_big != NULL)
-	{
-		if (current_big == ptr)
-		{
-			if (previous_big != NULL)
-				previous_big->next = current_big->next;
-			free(current_big);
-			return true;
-		}
+	big_chunk *chunk = chunk_of(ptr);
 
-		previous_big = current_big;
-		current_big = current_big->next;
+	if (chunk->previous != NULL)
+		chunk->previous->next = chunk->next;
+	else
+	{
+		assert(pool->big_list == chunk);
+		pool->big_list = chunk->next;
 	}
-	return false;
+
+	if (chunk->next != NULL)
+		chunk->next->previous = chunk->previous;
+
+	free(chunk);
+	return true;
+}
+
+static int size_class(size_t request_size)
+{
+	int size_class = 0;
+	while ((size_t(1) << (size_class + min_size_class_shift)) < request_size)
+		size_class++;
+	return size_class;
+}
+
+static size_t class_size(int size_class)
+{
+	return size_t(1) << (size_class + min_size_class_shift);
 }
 
 void *allocate(memory_pool *pool, size_t request_size)
 {
-	if (request_size >= sizeof(pool->small_list->bytes) / 4)
+	if (pool->remote_frees.load(std::memory_order_relaxed) != NULL)
+		collect_remote_frees(pool);
+
+	if (request_size > max_small_size)
 	{
 		// allocate large request and put on big_list
 		size_t chunk_size = offsetof( big_chunk, bytes) + request_size;
 		big_chunk *new_chunk =  ( big_chunk *) malloc(chunk_size);
 		assert(new_chunk != NULL);
 
+		new_chunk->size = request_size;
+		new_chunk->owner = pool;
+		new_chunk->previous = NULL;
 		new_chunk->next = pool->big_list;
+		if (pool->big_list != NULL)
+			pool->big_list->previous = new_chunk;
 		pool->big_list = new_chunk;
+		account(pool, request_size, 0);
 		return new_chunk->bytes;
 	}
-	else
-		if (pool->small_list == NULL ||
-				(sizeof(pool->small_list->bytes) < pool->small_list->offset + request_size))
-		{
-			// allocate small request and put on small_list
-			size_t chunk_size = sizeof(small_chunk);
-			small_chunk *new_chunk = ( small_chunk *) malloc(chunk_size);
-			assert(new_chunk != NULL);
-			new_chunk->next = pool->small_list;
-			new_chunk->offset = 0;
-			pool->small_list = new_chunk;
-		}
-	// return address from small_list
+
+	const int index = size_class(request_size);
+	const size_t size = class_size(index);
+	account(pool, size, 0);
+	free_block *block = pool->free_lists[index];
+	if (block != NULL)
+	{
+		pool->free_lists[index] = block->next;
+		return block;
+	}
+
+	if (pool->small_list == NULL ||
+			(sizeof(pool->small_list->bytes) < pool->small_list->offset + size))
+	{
+		// allocate small request and put on small_list, page alignment lets find chunk from block
+		small_chunk *new_chunk = ( small_chunk *) aligned_alloc(page_size, sizeof(small_chunk));
+		assert(new_chunk != NULL);
+		new_chunk->next = pool->small_list;
+		new_chunk->offset = 0;
+		new_chunk->owner = pool;
+		pool->small_list = new_chunk;
+	}
+	// return address from small_list, offset stays multiple of 16 because every class is
 	void *result = pool->small_list->bytes + pool->small_list->offset;
-	pool->small_list->offset += request_size;
+	pool->small_list->offset += size;
 	return result;
 }
 
@@ -87,18 +146,112 @@ void *callocate(memory_pool *pool, size_t request_size)
     return ptr;
 }
 
-
-void *reallocate(memory_pool *pool, size_t request_size, size_t old_request_size, void *ptr)
+void deallocate(memory_pool *pool, void *ptr, size_t request_size)
 {
-	void *new_ptr = allocate(pool, request_size);
-	memcpy(new_ptr, ptr, old_request_size);
+	if (ptr == NULL)
+		return;
 
-	if (old_request_size >= sizeof(pool->small_list->bytes) / 4)
+	if (request_size > max_small_size)
 	{
+		assert(chunk_of(ptr)->size == request_size);
+		account(pool, 0, request_size);
 		destroy_chunk(pool, ptr);
+		return;
 	}
-	return new_ptr;
+
+	const int index = size_class(request_size);
+	account(pool, 0, class_size(index));
+	free_block *block = (free_block *) ptr;
+	block->next = pool->free_lists[index];
+	pool->free_lists[index] = block;
+}
+
+memory_pool *owner_of(void *ptr, size_t request_size)
+{
+	if (request_size > max_small_size)
+		return chunk_of(ptr)->owner;
+
+	small_chunk *chunk = (small_chunk *) ((uintptr_t)ptr & ~(uintptr_t)(page_size - 1));
+	return chunk->owner;
 }
 
+void deallocate(void *ptr, size_t request_size)
+{
+	if (ptr == NULL)
+		return;
 
+	memory_pool *owner = owner_of(ptr, request_size);
+	if (owner == local_pool)
+	{
+		deallocate(owner, ptr, request_size);
+		return;
+	}
+
+	free_block *block = (free_block *) ptr;
+	block->size = request_size;
+	block->next = owner->remote_frees.load(std::memory_order_relaxed);
+	while (!owner->remote_frees.compare_exchange_weak(block->next, block,
+													  std::memory_order_release,
+													  std::memory_order_relaxed))
+		;
+}
 
+void collect_remote_frees(memory_pool *pool)
+{
+	free_block *block = pool->remote_frees.exchange(NULL, std::memory_order_acquire);
+	while (block != NULL)
+	{
+		free_block *next = block->next;
+		deallocate(pool, block, block->size);
+		block = next;
+	}
+}
+
+namespace
+{
+	// owns pool created lazily for thread which isn't event loop
+	struct thread_pool_guard
+	{
+		memory_pool *pool = NULL;
+
+		~thread_pool_guard()
+		{
+			if (pool == NULL)
+				return;
+			if (local_pool == pool)
+				local_pool = NULL;
+			destroy_pool(pool);
+			delete pool;
+		}
+	};
+
+	thread_local thread_pool_guard guard;
+}
+
+memory_pool *thread_pool()
+{
+	if (local_pool == NULL)
+	{
+		guard.pool = new memory_pool;
+		init_pool(guard.pool);
+		local_pool = guard.pool;
+	}
+	return local_pool;
+}
+
+void set_thread_pool(memory_pool *pool)
+{
+	local_pool = pool;
+}
+
+void *reallocate(memory_pool *pool, size_t request_size, size_t old_request_size, void *ptr)
+{
+	if (request_size <= max_small_size && old_request_size <= max_small_size &&
+			size_class(request_size) == size_class(old_request_size))
+		return ptr;
+
+	void *new_ptr = allocate(pool, request_size);
+	memcpy(new_ptr, ptr, old_request_size < request_size? old_request_size : request_size);
+	deallocate(pool, ptr, old_request_size);
+	return new_ptr;
+}
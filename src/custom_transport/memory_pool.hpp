@@ -2,6 +2,7 @@
 #define MEMORY_POOL_HPP
 
 #include <cstddef>
+#include <atomic>
 
 /*
  * In C++ there is need for casting from malloc against compilation errors (-fpermissive
@@ -34,23 +35,56 @@
 
 constexpr static int page_size = 4096;
 
+/*
+ * Small requests (up to max_small_size) are rounded up to one of size classes (16, 32, ... 1024 B)
+   and carved from small_chunk pages. Freed small block goes on free list of its class, so next
+   allocation of the same class is just pop from that list. Caller passes size to deallocate
+   (it always knows it - e.g. buffer capacity) so there is no per-block header.
+ * Big requests get own malloc-ed big_chunk linked in doubly linked list, so freeing is O(1) too.
+
+ * Pools are not thread-safe and every pool is owned by one thread (event loop or worker, see
+   thread_pool). small_chunk pages are page aligned and big_chunk has header so owner of any block
+   is found from pointer alone. Block released by foreign thread is pushed on owner's lock-free
+   remote_frees stack (free_block keeps size) and owner takes whole stack at once later
+   (in allocate or collect_remote_frees) - so handing buffer from I/O thread to worker
+   and back needs neither lock nor allocation.
+*/
+constexpr static int min_size_class_shift = 4;
+constexpr static int size_classes_number = 7;
+constexpr static size_t max_small_size = size_t(1) << (min_size_class_shift + size_classes_number - 1);
+
+struct memory_pool;
+
 struct small_chunk
 {
 	small_chunk *next;
 	size_t offset;
-	char bytes[page_size - sizeof(void*) * 2];
+	memory_pool *owner;
+	alignas(16) char bytes[page_size - sizeof(void*) * 4];
 };
 
 struct big_chunk
 {
-	big_chunk *next;
-	char bytes[1];
+	big_chunk *previous, *next;
+	size_t size;
+	memory_pool *owner;
+	alignas(16) char bytes[1];
+};
+
+struct free_block
+{
+	free_block *next;
+	size_t size;
 };
 
 struct memory_pool
 {
 	small_chunk *small_list;
 	big_chunk *big_list;
+	free_block *free_lists[size_classes_number];
+	std::atomic<free_block*> remote_frees;
+	// bytes of blocks handed out (rounded up to size class), written only by owner
+	std::atomic<size_t> bytes_in_use;
 };
 
 extern void init_pool(memory_pool *pool);
@@ -60,6 +94,20 @@ extern void *allocate(memory_pool *pool, size_t request_size);
 extern void *callocate(memory_pool *pool, size_t request_size);
 extern void *reallocate(memory_pool *pool, size_t request_size,
 						size_t old_request_size, void *ptr);
+// request_size must be the same as passed to allocate
+extern void deallocate(memory_pool *pool, void *ptr, size_t request_size);
+// may be called from any thread, block goes back to pool which allocated it
+extern void deallocate(void *ptr, size_t request_size);
+extern void collect_remote_frees(memory_pool *pool);
+// pool which allocated block (request_size as passed to allocate)
+extern memory_pool *owner_of(void *ptr, size_t request_size);
 
-#endif // MEMORY_POOL_HPP
+/*
+ * Pool of calling thread. Event loop registers own pool by set_thread_pool, for other threads
+   pool is created on first use and destroyed on thread exit - so all blocks allocated by such thread
+   must be released before it finishes.
+ */
+extern memory_pool *thread_pool();
+extern void set_thread_pool(memory_pool *pool);
 
+#endif // MEMORY_POOL_HPP
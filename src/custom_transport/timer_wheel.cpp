@@ -0,0 +1,157 @@
+#include <cassert>
+#include <climits>
+#include <cstring>
+
+#include "timer_wheel.hpp"
+
+constexpr static uint64_t slot_mask = timer_slots - 1;
+constexpr static uint64_t max_delay = (uint64_t(1) << (timer_levels * timer_slot_bits)) - 1;
+
+static int level_shift(int level)
+{
+	return level * timer_slot_bits;
+}
+
+void init_timer_wheel(timer_wheel *wheel, uint64_t now)
+{
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now = now;
+}
+
+/*
+ * Level is chosen by distance from now, slot by expiry itself - so timer from level L is cascaded
+   exactly when its block of 2^(8L) ticks begins and lands in level below (finally in its tick slot).
+ */
+static void link(timer_wheel *wheel, timer_node *node)
+{
+	if (node->expires <= wheel->now)
+		node->expires = wheel->now + 1;
+	if (node->expires - wheel->now > max_delay)
+		node->expires = wheel->now + max_delay;
+
+	const uint64_t delay = node->expires - wheel->now;
+	int level = 0;
+	while (level < timer_levels - 1 && delay >= (uint64_t(1) << level_shift(level + 1)))
+		level++;
+
+	timer_node **slot = &wheel->slots[level][(node->expires >> level_shift(level)) & slot_mask];
+	node->level = level;
+	node->next = *slot;
+	if (node->next != NULL)
+		node->next->previous_next = &node->next;
+	node->previous_next = slot;
+	*slot = node;
+	wheel->timers[level]++;
+}
+
+static void unlink(timer_wheel *wheel, timer_node *node)
+{
+	*node->previous_next = node->next;
+	if (node->next != NULL)
+		node->next->previous_next = node->previous_next;
+	node->next = NULL;
+	node->previous_next = NULL;
+	wheel->timers[node->level]--;
+}
+
+void schedule_timer(timer_wheel *wheel, timer_node *node, uint64_t expires)
+{
+	if (timer_armed(node))
+		unlink(wheel, node);
+	node->expires = expires;
+	link(wheel, node);
+}
+
+void unschedule_timer(timer_wheel *wheel, timer_node *node)
+{
+	if (timer_armed(node))
+		unlink(wheel, node);
+}
+
+// tick begins new block of level 1 (and maybe of higher levels too)
+static void cascade(timer_wheel *wheel, uint64_t tick)
+{
+	for (int level = 1; level < timer_levels; level++)
+	{
+		const uint64_t index = (tick >> level_shift(level)) & slot_mask;
+		timer_node *node = wheel->slots[level][index];
+		wheel->slots[level][index] = NULL;
+		while (node != NULL)
+		{
+			timer_node *next = node->next;
+			wheel->timers[level]--;
+			link(wheel, node);
+			node = next;
+		}
+
+		if (index != 0)
+			break;
+	}
+}
+
+size_t advance_timer_wheel(timer_wheel *wheel, uint64_t now)
+{
+	size_t fired = 0;
+	while (wheel->now < now)
+	{
+		if (wheel->timers[0] == 0)
+		{
+			// nothing in level 0, so only next cascade may bring something
+			const uint64_t last = wheel->now | slot_mask;
+			if (last >= now)
+			{
+				wheel->now = now;
+				break;
+			}
+			wheel->now = last;
+		}
+
+		const uint64_t tick = ++wheel->now;
+		if ((tick & slot_mask) == 0)
+			cascade(wheel, tick);
+
+		timer_node **slot = &wheel->slots[0][tick & slot_mask];
+		while (*slot != NULL)
+		{
+			timer_node *node = *slot;
+			unlink(wheel, node);
+			fired++;
+			node->expire(node);
+		}
+	}
+	return fired;
+}
+
+int next_timer_timeout(const timer_wheel *wheel)
+{
+	uint64_t first = UINT64_MAX;
+	if (wheel->timers[0] > 0)
+		for (uint64_t tick = wheel->now + 1; tick <= wheel->now + timer_slots; tick++)
+			if (wheel->slots[0][tick & slot_mask] != NULL)
+			{
+				first = tick;
+				break;
+			}
+
+	// for higher levels it's beginning of block which cascades first non-empty slot
+	for (int level = 1; level < timer_levels; level++)
+	{
+		if (wheel->timers[level] == 0)
+			continue;
+		const uint64_t block = wheel->now >> level_shift(level);
+		for (uint64_t next = block + 1; next <= block + timer_slots; next++)
+			if (wheel->slots[level][next & slot_mask] != NULL)
+			{
+				const uint64_t tick = next << level_shift(level);
+				if (tick < first)
+					first = tick;
+				break;
+			}
+	}
+
+	if (first == UINT64_MAX)
+		return -1;
+	assert(first > wheel->now);
+	const uint64_t timeout = first - wheel->now;
+	return (timeout > uint64_t(INT_MAX))? INT_MAX : int(timeout);
+}
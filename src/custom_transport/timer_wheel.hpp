@@ -0,0 +1,52 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Hierarchical timer wheel (like classic Linux kernel timers) with 1 ms tick. 4 levels of 256 slots
+   cover 2^32 ms (~49 days). Level 0 keeps timers due within 256 ms, timers from higher level are
+   cascaded one level down when level below wraps.
+ * Timer is intrusive node (e.g. member of connection_data) so arming, re-arming and cancelling is
+   only O(1) list link/unlink - no allocation and no search.
+ * Timer never fires before its expiry tick. Timers due in the same tick fire in no particular order.
+ * Wheel is not thread-safe, every event loop has own one.
+ */
+constexpr static int timer_levels = 4;
+constexpr static int timer_slot_bits = 8;
+constexpr static int timer_slots = 1 << timer_slot_bits;
+
+struct timer_node
+{
+	timer_node *next;
+	timer_node **previous_next; // NULL - not armed
+	uint64_t expires; // ms
+	int level;
+	void (*expire)(timer_node *node);
+	void *owner;
+};
+
+struct timer_wheel
+{
+	uint64_t now; // last processed tick
+	size_t timers[timer_levels];
+	timer_node *slots[timer_levels][timer_slots];
+};
+
+extern void init_timer_wheel(timer_wheel *wheel, uint64_t now);
+// arms or re-arms node, expiry in the past fires in next tick
+extern void schedule_timer(timer_wheel *wheel, timer_node *node, uint64_t expires);
+extern void unschedule_timer(timer_wheel *wheel, timer_node *node);
+
+inline bool timer_armed(const timer_node *node)
+{
+	return node->previous_next != NULL;
+}
+
+// fires every timer due until now (expire may arm or cancel any timer), returns number of fired
+extern size_t advance_timer_wheel(timer_wheel *wheel, uint64_t now);
+// ms after which some timer may be due (never later than first expiry), -1 when wheel is empty
+extern int next_timer_timeout(const timer_wheel *wheel);
+
+#endif // TIMER_WHEEL_HPP
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <netdb.h>
 /*
    Custom transport as simple library replacement for boost::asio.
    Under the hood simple TCP epoll server + callbacks.
@@ -60,20 +61,21 @@ void write_handler(int bytes_transferred, connection_data *connection)
 //        else
 //            logger_.log("Send back %d bytes. Send all data to client socket = %d. ", bytes_transferred,
 //                    connection->fd);
-		async_read(read_handler, connection);
+		async_read(connection);
 	}
 }
 
+// received segments go to outbound queue as they are - echo never copies payload
 void prepare_echo_response(connection_data *connection)
 {
-	async_write(write_handler, connection);
+	async_write_segments(connection);
 }
 
 void read_handler(int bytes_transferred, connection_data *connection)
 {
 	if(bytes_transferred == 0)
 	{
-        logger_.log("Client closed connection. Detected in read_handler");
+        LOG_DEBUG("Client closed connection. Detected in read_handler");
 	}
 	else
 	{
@@ -88,33 +90,45 @@ void read_handler(int bytes_transferred, connection_data *connection)
 	}
 }
 
-void accept_handler(int error, connection_data *connection,
-					const char *address, const char *port)
+void accept_handler(int error, connection_data *connection)
 {
 	if (error == 0)
 	{
-        logger_.log("Accepted connection on descriptor %d "
+        char address[NI_MAXHOST], port[NI_MAXSERV];
+        peer_address(connection, address, sizeof address, port, sizeof port);
+        LOG_DEBUG("Accepted connection on descriptor %d "
                "(host=%s, port=%s)", connection->fd, address, port);
+        // handlers are installed once per connection and only re-armed later
+        connection->write_handler = write_handler;
+        set_segmented_reads(connection, true);
         async_read(read_handler, connection);
 	}
 	else
 	{
-		logger_.log("Connection accepting failed");
+		LOG_ERROR("Connection accepting failed");
 	}
 }
 
 int main(int argc, char* argv[])
 {
-    if (argc != 2)
+    if (argc < 2 || argc > 5)
     {
-		logger_.log("Usage: %s [port]", argv[0]);
+		LOG_ERROR("Usage: %s [port] [loops] [stats_interval_ms] [epoll|io_uring]", argv[0]);
         exit(EXIT_FAILURE);
     }
 
 	//logger_.enable(false);
+	// handlers run on I/O thread, so lines are only recorded there and written by logger thread
+	logger_.set_async(true);
 	async_accept(accept_handler);
 	int port = atoi(argv[1]);
-	init(port);
+	transport_options options;
+	options.loops_number = (argc >= 3)? atoi(argv[2]) : 1;
+	options.pin_loops = options.loops_number > 1;
+	options.stats_interval_ms = (argc >= 4)? atoi(argv[3]) : 0;
+	if (argc == 5 && strcmp(argv[4], "io_uring") == 0)
+		options.backend = io_backend::io_uring;
+	init(port, options);
 	run();
     return 0;
 }
@@ -2,27 +2,225 @@
 #define BYTE_BUFFER_HPP
 
 #include <cstring>
-#include <array>
 #include <cassert>
 #include <vector>
+#include <string>
 #include <type_traits>
 
 namespace serialization
 {
 
-const static int max_size = 300;
+// start capacity of own storage, it's not limit anymore - buffer grows when needed
+const static int initial_size = 300;
 
+/*
+ * Views are zero-copy alternative of get_string/get_vector_value for read-mostly handlers.
+   They point into buffer from which message was deserialized (e.g. frame in connection buffer)
+   so they are valid only as long as that memory - for received message it's handler call.
+ */
+struct string_ref
+{
+    const char *data() const
+    {
+        return bytes;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+    bool empty() const
+    {
+        return length == 0;
+    }
+
+    char operator[](size_t i) const
+    {
+        return bytes[i];
+    }
+
+    std::string to_string() const
+    {
+        return std::string(bytes, length);
+    }
+
+    bool operator==(const std::string &other) const
+    {
+        return other.size() == length && memcmp(other.data(), bytes, length) == 0;
+    }
+
+    const char *bytes;
+    size_t length;
+};
+
+// elements are copied out one by one because payload doesn't have to be aligned for T
+template<class T>
+struct array_view
+{
+    static_assert(std::is_trivially_copyable<T>::value, "array_view needs trivially copyable T");
+
+    struct iterator
+    {
+        T operator*() const
+        {
+            T value;
+            memcpy(&value, position, sizeof(value));
+            return value;
+        }
+
+        iterator &operator++()
+        {
+            position += sizeof(T);
+            return *this;
+        }
+
+        bool operator!=(const iterator &other) const
+        {
+            return position != other.position;
+        }
+
+        const unsigned char *position;
+    };
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    T operator[](size_t i) const
+    {
+        return *iterator{bytes + i*sizeof(T)};
+    }
+
+    iterator begin() const
+    {
+        return iterator{bytes};
+    }
+
+    iterator end() const
+    {
+        return iterator{bytes + count*sizeof(T)};
+    }
+
+    std::vector<T> to_vector() const
+    {
+        std::vector<T> result(count);
+        if (count > 0)
+            memcpy(&result[0], bytes, count*sizeof(T));
+        return result;
+    }
+
+    const unsigned char *bytes;
+    size_t count;
+};
+
+/*
+ * byte_buffer works on memory pointed by m_byte_buffer in one of 3 modes:
+   - own storage (default constructor) - vector which grows expotentialy,
+   - read only view on received message (e.g. frame in connection buffer) - nothing is copied,
+     reading behind view is an error,
+   - external storage - when there is no room grow(context, capacity) is asked for bigger memory
+     (e.g. outbound buffer of connection in epoll_server::response_buffer) so message is
+     serialized directly to place from which it will be sent.
+ * Bytes [0, offset) are message built/read so far.
+ */
 struct byte_buffer
 {
-    byte_buffer() : offset(0) {}
+    // returns memory with at least capacity bytes (first ones kept) and sets capacity to real one
+    typedef unsigned char *(*grow_function)(void *context, int &capacity);
+
+    byte_buffer()
+        : storage(initial_size),
+          m_byte_buffer(&storage[0]),
+          offset(0),
+          capacity(initial_size),
+          grow(nullptr),
+          context(nullptr)
+    {
+    }
+
+    byte_buffer(const unsigned char *bytes, int size)
+        : m_byte_buffer(const_cast<unsigned char *>(bytes)),
+          offset(0),
+          capacity(size),
+          grow(nullptr),
+          context(nullptr)
+    {
+    }
+
+    byte_buffer(grow_function grow, void *context)
+        : m_byte_buffer(nullptr),
+          offset(0),
+          capacity(0),
+          grow(grow),
+          context(context)
+    {
+    }
+
+    byte_buffer(const byte_buffer &other)
+        : storage(other.storage),
+          m_byte_buffer(storage.empty()? other.m_byte_buffer : &storage[0]),
+          offset(other.offset),
+          capacity(other.capacity),
+          grow(other.grow),
+          context(other.context)
+    {
+    }
+
+    byte_buffer &operator=(const byte_buffer &other)
+    {
+        storage = other.storage;
+        m_byte_buffer = storage.empty()? other.m_byte_buffer : &storage[0];
+        offset = other.offset;
+        capacity = other.capacity;
+        grow = other.grow;
+        context = other.context;
+        return *this;
+    }
+
+    // makes room for size bytes after offset
+    void reserve(int size)
+    {
+        const int needed = offset + size;
+        if (needed <= capacity)
+            return;
+
+        if (!storage.empty())
+        {
+            int new_capacity = capacity;
+            while (new_capacity < needed)
+                new_capacity *= 2;
+            storage.resize(new_capacity);
+            m_byte_buffer = &storage[0];
+            capacity = new_capacity;
+        }
+        else
+        {
+            assert(grow != nullptr); // read only view
+            capacity = needed;
+            m_byte_buffer = grow(context, capacity);
+            assert(capacity >= needed);
+        }
+    }
+
+    bool writes_to(const void *context) const
+    {
+        return grow != nullptr && this->context == context;
+    }
 
     template<class T>
     void put_value(typename std::enable_if<std::is_integral<T>::value, T>::type
                    value)
     {
+        reserve(sizeof(value));
         memcpy(&m_byte_buffer[offset], &value, sizeof(value));
         offset += sizeof(value);
-        assert(offset < max_size);
     }
 
     template<class T>
@@ -33,28 +231,28 @@ struct byte_buffer
         put_int(size);
         if (size > 0)
         {
+            reserve(size);
             memcpy(&m_byte_buffer[offset], &value[0], size);
             offset += size;
         }
-        assert(offset < max_size);
     }
 
     void put_string(const std::string &value)
     {
         size_t size = value.size()*sizeof(char);
         put_int(size);
+        reserve(size);
         memcpy(&m_byte_buffer[offset], &value[0], size);
         offset += size;
-        assert(offset < max_size);
     }
 
     template<class T>
     typename std::enable_if<std::is_integral<T>::value, T>::type get_value()
     {
         T value;
+        assert(offset + (int)sizeof(value) <= capacity);
         memcpy(&value, &m_byte_buffer[offset], sizeof(value));
         offset += sizeof(value);
-        assert(offset < max_size);
         return value;
     }
 
@@ -62,13 +260,13 @@ struct byte_buffer
     std::vector<T> get_vector_value()
     {
         size_t size = get_int();
+        assert(offset + size <= (size_t)capacity);
         std::vector<T> value(size / sizeof(T), 0);
         if (size > 0)
         {
             memcpy(&value[0], &m_byte_buffer[offset], size);
             offset += size;
         }
-        assert(offset < max_size);
         return value;
     }
 
@@ -145,9 +343,28 @@ struct byte_buffer
     std::string get_string()
     {
         size_t size = get_int();
+        assert(offset + size <= (size_t)capacity);
         std::string result(&m_byte_buffer[offset], &m_byte_buffer[offset + size]);
         offset += size;
-        assert(offset < max_size);
+        return result;
+    }
+
+    string_ref get_string_ref()
+    {
+        size_t size = get_int();
+        assert(offset + size <= (size_t)capacity);
+        string_ref result = {reinterpret_cast<const char *>(&m_byte_buffer[offset]), size};
+        offset += size;
+        return result;
+    }
+
+    template<class T>
+    array_view<T> get_array_view()
+    {
+        size_t size = get_int();
+        assert(offset + size <= (size_t)capacity && size % sizeof(T) == 0);
+        array_view<T> result = {&m_byte_buffer[offset], size / sizeof(T)};
+        offset += size;
         return result;
     }
 
@@ -166,8 +383,12 @@ struct byte_buffer
         return offset;
     }
 
-    std::array<unsigned char, max_size> m_byte_buffer;
+    std::vector<unsigned char> storage;
+    unsigned char *m_byte_buffer;
     int offset;
+    int capacity;
+    grow_function grow;
+    void *context;
 };
 
 }
@@ -1,87 +1,58 @@
 #include "epoll_server.hpp"
 #include "logger.hpp"
+#include <netdb.h>
 
-void epoll_server::write_handler(int bytes_transferred, connection_data *connection)
+/*
+ * Transport delivers whole messages now (length prefix, framing mode) so there is no
+   remaining_bytes/current bookkeeping here anymore and nothing is lost between reads.
+   Message is deserialized directly from connection buffer (byte_buffer view), nothing is copied.
+ * Requests are framed with one size byte (u8) by default, so existing clients work unchanged and
+   request is at most 255 B. Server created with frame_prefix::varint takes requests of any size
+   (up to MAXLEN) - prefix of message shorter than 128 B is the same single byte, longer messages
+   just take more bytes of prefix. Both sides must agree on prefix.
+ * Pipelining: all complete messages from one read batch are dispatched here one after another
+   (reading stays armed, nobody waits for previous response to be sent) and responses queued
+   meanwhile go out together in one sendmsg after batch.
+ */
+void epoll_server::frame_handler(const char *frame, size_t size, connection_data *connection)
 {
-	if (bytes_transferred >= 0)
+	if (connection == NULL)
 	{
-		logger_.log("server: connection on socket = %d: sent %d B", connection->fd, bytes_transferred);
-		connection->from = 0;
-		async_read(my_boost::my_bind(&epoll_server::read_handler, *this, my_boost::_1), connection);
+		LOG_DEBUG("server: frame_handler; connection on socket = was removed");
+		return;
 	}
-	else
-	{
-		logger_.log("server: connection on socket = was removed");
-	}
-}
-
-void epoll_server::read_handler(int bytes_transferred, connection_data *connection)
-{
-	if(bytes_transferred == 0)
-	{
-		logger_.log("server: read_handler; connection on socket = was removed");
-	}
-	else
-	{
-		current_connection = connection;
-		// no problem with strict aliasing because connection->data type is char*
-		private_data *data = reinterpret_cast<private_data*>(connection->data);
-		unsigned char msg_length = 0;
 
-		if (data->remaining_bytes == 0)
-		{
-			msg_length = data->data_buffer.m_byte_buffer[0];
-			data->remaining_bytes =  msg_length + 1 - bytes_transferred;
-			data->current = bytes_transferred;
-		}
-		else
-		{
-			data->remaining_bytes -= bytes_transferred;
-			data->current += bytes_transferred;
-		}
+	assert(dispatcher != nullptr);
+	LOG_TRACE("server: connection on socket = %d: recieved %zu B. Got full msg",
+				connection->fd, size);
 
-		if (data->remaining_bytes > 0)
-		{
-			logger_.log("server: connection on socket = %d: recieved %d B and expected %d B. Waiting for next %d B",
-										 connection->fd, bytes_transferred,
-										 msg_length + 1, data->remaining_bytes);
-			// TO DO: I need buffer(&data_buffer.m_byte_buffer[current], remaining_bytes)
-			// so I want read to arbitrary choosed point in data and arbitrary number of bytes.
-			// But what if I will send on client side 1GB of data. ET must read all data but I only read
-			// MAXLEN/arbitrary bytes number. Is it OK? What about lost of data?
-			connection->from = data->current;
-			async_read(my_boost::my_bind(&epoll_server::read_handler, *this, my_boost::_1), connection);
-		}
-		else
-		{
-			assert(dispatcher != nullptr);
-			logger_.log("server: connection on socket = %d: recieved %d B and expected %d B. Got full msg",
-						connection->fd, bytes_transferred, bytes_transferred);
-
-			data->data_buffer.offset = 1;
-			dispatcher->dispatch_msg_from_buffer(data->data_buffer);
-		}
-	}
+	current_connection = connection;
+	serialization::byte_buffer request(reinterpret_cast<const unsigned char *>(frame), size);
+	dispatcher->dispatch_msg_from_buffer(request);
 }
 
-void epoll_server::accept_handler(int error, connection_data *connection,
-                    const char *address, const char *port)
+void epoll_server::accept_handler(int error, connection_data *connection)
 {
     if (error == 0)
     {
-		logger_.log("Accepted connection on descriptor %d "
+        char address[NI_MAXHOST], port[NI_MAXSERV];
+        peer_address(connection, address, sizeof address, port, sizeof port);
+		LOG_DEBUG("Accepted connection on descriptor %d "
 			   "(host=%s, port=%s)", connection->fd, address, port);
-		async_read(my_boost::my_bind(&epoll_server::read_handler, *this, my_boost::_1), connection);
+		async_read_frames(my_boost::my_bind(&epoll_server::frame_handler, *this, my_boost::_1),
+						  connection, request_prefix, max_request_size);
     }
     else
     {
-		logger_.log("Connection accepting failed");
+		LOG_ERROR("Connection accepting failed");
     }
 }
 
-epoll_server::epoll_server(int port)
+epoll_server::epoll_server(int port, frame_prefix request_prefix)
 	: current_connection(nullptr),
-	  dispatcher(nullptr)
+	  dispatcher(nullptr),
+	  request_prefix(request_prefix),
+	  max_request_size((request_prefix == frame_prefix::u8)? UINT8_MAX : MAXLEN)
 {
 	async_accept(my_boost::my_bind(&epoll_server::accept_handler, *this, my_boost::_1));
 	init(port);
@@ -97,13 +68,33 @@ void epoll_server::run()
 	::run();
 }
 
-void epoll_server::send_on_current_connection(const serialization::byte_buffer &data)
+static unsigned char *grow_response(void *context, int &capacity)
+{
+	connection_data *connection = static_cast<connection_data *>(context);
+	buffer *data = prepare_write(connection, capacity);
+	capacity = data->capacity - data->size;
+	return reinterpret_cast<unsigned char *>(data->bytes + data->size);
+}
+
+serialization::byte_buffer epoll_server::response_buffer()
 {
 	assert(current_connection != nullptr);
-	private_data *connection = reinterpret_cast<private_data*>(current_connection->data);
-	connection->data_buffer = data;
+	return serialization::byte_buffer(grow_response, current_connection);
+}
 
-	current_connection->from = 0;
-	current_connection->length = connection->data_buffer.offset;
-	async_write(my_boost::my_bind(&epoll_server::write_handler, *this, my_boost::_1), current_connection);
+/*
+ * Response is queued without completion handler so pipelined responses are coalesced.
+   Buffer from response_buffer is already in outbound queue memory and is only committed,
+   any other one is copied.
+ */
+void epoll_server::send_on_current_connection(const serialization::byte_buffer &data)
+{
+	assert(current_connection != nullptr);
+	if (data.writes_to(current_connection))
+	{
+		if (data.offset > 0)
+			commit_write(current_connection, data.offset);
+		return;
+	}
+	queue_write(current_connection, reinterpret_cast<const char *>(data.m_byte_buffer), data.offset);
 }
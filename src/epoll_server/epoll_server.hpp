@@ -16,9 +16,13 @@ namespace my_boost
 		{
 		};
 
-		placeholder _1;
+		[[maybe_unused]] placeholder _1;
 	}
 
+	/*
+	 * binder keeps only pointer to context (not a copy) so it's trivially copyable, fits in
+	   inline_function slot and handler works on the same object which was bound.
+	 */
 	template<class R, class T, class... Args>
 	class binder
 	{
@@ -26,55 +30,51 @@ namespace my_boost
 		typedef R (T::*fn)(Args...);
 
 	public:
-		binder(fn method, T context)
+		binder(fn method, T &context)
 			: method_(method),
-			  context_(context)
+			  context_(&context)
 		{
 		}
 
 		R operator ()(Args... args)
 		{
-			return (context_.*method_)(args...);
+			return (context_->*method_)(args...);
 		}
 
 	private:
 		fn method_;
-		T context_;
+		T *context_;
 	};
 
 	template<class R, class T, class... Args>
 	binder<R, T, Args...> my_bind(R (T::*method)(Args...),
-										 const T &context, const placeholder &)
+										 T &context, const placeholder &)
 	{
 		return binder<R, T, Args...>(method, context);
 	}
 }
 
-struct private_data
-{
-	serialization::byte_buffer data_buffer;
-	int remaining_bytes {0};
-	int current {0};
-};
-
 class epoll_server //singleton - global variables
 {
 public:
-    epoll_server(int port);
+    // request_prefix - length prefix of requests, u8 (default) keeps old wire format
+    epoll_server(int port, frame_prefix request_prefix = frame_prefix::u8);
 	void add_dispatcher(std::shared_ptr<networking::message_dispatcher> dispatcher);
     void run();
     //void stop();
+	// response serialized to this buffer goes to connection without any copy
+	serialization::byte_buffer response_buffer();
 	void send_on_current_connection(const serialization::byte_buffer &data);
 
 private:
-	void write_handler(int bytes_transferred, connection_data *connection);
 	// Not static anymore:)
-	void read_handler(int bytes_transferred, connection_data *connection);
-	void accept_handler(int error, connection_data *connection,
-                   const char *address, const char *port);
+	void frame_handler(const char *frame, size_t size, connection_data *connection);
+	void accept_handler(int error, connection_data *connection);
 
 	connection_data *current_connection;
 	std::shared_ptr<networking::message_dispatcher> dispatcher;
+	const frame_prefix request_prefix;
+	const size_t max_request_size;
 };
 
 #endif // EPOLL_SERVER_HPP
@@ -92,6 +92,7 @@ int main(int argc, char* argv[])
         printf("Usage: %s [port]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
+	logger_.set_async(true);
 	epoll_server server(atoi(argv[1]));
 	server.run();
     return 0;
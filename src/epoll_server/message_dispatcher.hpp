@@ -6,10 +6,11 @@
 #include <string>
 #include <functional>
 #include <vector>
-#include <map>
+#include <array>
 
 #include "logger.hpp"
 #include "byte_buffer.hpp"
+#include "message_fields.hpp"
 
 namespace networking
 {
@@ -24,7 +25,8 @@ namespace networking
    2. Observing callstack is good idea to understanding how it works
  */
 
-typedef std::function<bool(serialization::byte_buffer &buffer)> dispatcher_type;
+// message id is already consumed from buffer when dispatcher is called
+typedef std::function<void(serialization::byte_buffer &buffer)> dispatcher_type;
 
 // those traits converts argument sequence e.g. int, std::string, Foo.. to std::tuple<int, std::string, Foo>
 template<typename T>
@@ -42,72 +44,62 @@ struct function_traits<R(C::*)(Arg) const>
     using arg_type = Arg;
 };
 
-
-template<typename T>
-struct dispatcher_maker;
-
-template<typename Arg>
-struct dispatcher;
-
-
-template<typename Arg>
-struct dispatcher_maker
-{
-    template<typename F>
-    dispatcher_type make(F&& f)
-    {
-        return dispatcher<Arg>{std::forward<F>(f)};
-    }
-};
-
+// message type handled by callable F
 template<typename F>
-dispatcher_type make_dispatcher(F&& f) // add dispatcher_type
-{
-    using f_type = decltype(&F::operator()); // e.g. void (message_dispatcher_test_case()::<lambda(int)>::*)(int) const
-    using arg_type = typename function_traits<f_type>::arg_type; // e.g std::tuple<int>
+using message_type = typename std::decay<
+    typename function_traits<decltype(&std::decay<F>::type::operator())>::arg_type>::type;
 
-    return dispatcher_maker<arg_type>().make(std::forward<F>(f)); // temporary dispatcher_maker<arg_type>
-}
-
-template<typename Arg>
+/*
+ * Handler is kept by value (not in second std::function) so dispatching message is one
+   indirect call + deserialization + inlined handler.
+ * Message lives on stack only for handler call. If it has view fields (string_ref, array_view)
+   they point into receive buffer, so such handler decodes message without any allocation but
+   mustn't keep views after return.
+ */
+template<typename Msg, typename F>
 struct dispatcher
 {
-    template<typename F> dispatcher(F f) : handler(std::move(f)) { }
+    dispatcher(F f) : handler(std::move(f)) { }
 
-    bool operator() (serialization::byte_buffer &buffer)
+    void operator() (serialization::byte_buffer &buffer)
     {
-        typedef typename std::remove_reference<Arg>::type Msg;
-        int id = buffer.m_byte_buffer[buffer.offset];
-
-        if (id == Msg::message_id())
-        {
-            Msg msg = {};
-            buffer.offset++;
-            msg.deserialize_from_buffer(buffer);
-            handler(msg);
-            return true;
-        }
-        return false;
+        Msg msg = {};
+        serialization::deserialize_message(buffer, msg);
+        handler(msg);
     }
 
 private:
-    std::function<void(Arg)> handler;
+    F handler;
 };
 
+template<typename F>
+dispatcher_type make_dispatcher(F&& f)
+{
+    return dispatcher<message_type<F>, typename std::decay<F>::type>{std::forward<F>(f)};
+}
+
 
 /*
  * be aware that there is no implicit conversion so 1.0 is double but 1.0f is float and "dupa"
    is c-string
  * static variables don't have to be captured by lambda!
+ * Message id is one byte on the wire so table indexed by id covers all possible messages and
+   dispatch is one lookup no matter how many handlers are registered.
  */
 struct message_dispatcher
 {
 public:
 
+    constexpr static int max_message_id = 255;
+
+    // first handler registered for message id wins
     template<typename F>
     void add_handler(F&& f)
     {
-        callbacks.emplace_back(make_dispatcher(std::forward<F>(f)));
+        const int id = message_type<F>::message_id();
+        assert(id >= 0 && id <= max_message_id);
+        if (!handlers[id])
+            handlers[id] = make_dispatcher(std::forward<F>(f));
     }
 
     void dispatch_msg_from_buffer(serialization::byte_buffer &buffer)
@@ -117,24 +109,20 @@ public:
 
     void dispatch(serialization::byte_buffer &buffer)
     {
-        for (auto some_dispatcher : callbacks)
+        assert(buffer.offset < buffer.capacity);
+        const int id = buffer.m_byte_buffer[buffer.offset];
+        const dispatcher_type &handler = handlers[id];
+        if (!handler)
         {
-            if (call(some_dispatcher, buffer))
-                return;
+            LOG_WARN("message dispatcher: there is no handler for this msg");
+            return;
         }
-        logger_.log("message dispatcher: there is no handler for this msg");
-    }
-
-private:
-
-    template<typename Dispatcher>
-    bool call(Dispatcher const& dispatcher, serialization::byte_buffer &buffer)
-    {
-        return dispatcher(buffer);
+        buffer.offset++;
+        handler(buffer);
     }
 
 private:
-    std::vector<dispatcher_type> callbacks;
+    std::array<dispatcher_type, max_message_id + 1> handlers;
 };
 
 }
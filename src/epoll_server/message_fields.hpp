@@ -0,0 +1,312 @@
+#ifndef MESSAGE_FIELDS_HPP
+#define MESSAGE_FIELDS_HPP
+
+#include <cstring>
+#include <cassert>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "byte_buffer.hpp"
+
+namespace serialization
+{
+
+/*
+ * Declarative serialization. Message lists its fields once:
+
+    struct position
+    {
+        static int message_id() { return 3; }
+        int id;
+        long x, y;
+        std::vector<int> path;
+        auto fields() { return std::tie(id, x, y, path); }
+    };
+
+   and serialize/deserialize are generated from this list at compile time.
+ * string_ref and array_view<T> fields have the same wire format as std::string and std::vector<T>,
+   so read-mostly handler may take view version of message (e.g. path as array_view<int>) and
+   decode it without any heap allocation.
+ * Wire format is the same as written by hand with byte_buffer put_* / get_* (integral value as raw
+   bytes, string and vector as int size in bytes + raw bytes) so both ways may be mixed.
+ * Fixed-size part of message (integral fields and size words) is computed at compile time.
+   serialize reserves whole message once and then only memcpy-s fields without any checks.
+   deserialize checks fixed part once up front and then one check per string/vector payload
+   (which also covers fixed part still left behind payload), vector payload is one memcpy.
+ */
+
+namespace detail
+{
+    template<class T, class Enable = void>
+    struct field;
+
+    template<class T>
+    struct field<T, typename std::enable_if<std::is_integral<T>::value>::type>
+    {
+        constexpr static size_t fixed_size = sizeof(T);
+
+        static size_t variable_size(const T &)
+        {
+            return 0;
+        }
+
+        static unsigned char *write(unsigned char *out, const T &value)
+        {
+            memcpy(out, &value, sizeof(value));
+            return out + sizeof(value);
+        }
+
+        static const unsigned char *read(const unsigned char *in, const unsigned char *, size_t, T &value)
+        {
+            memcpy(&value, in, sizeof(value));
+            return in + sizeof(value);
+        }
+    };
+
+    // reads size word and checks that payload and fixed part of following fields are in buffer
+    inline const unsigned char *read_payload_size(const unsigned char *in, const unsigned char *end,
+                                                  size_t fixed_left, size_t &size)
+    {
+        int value;
+        memcpy(&value, in, sizeof(value));
+        in += sizeof(value);
+        assert(value >= 0);
+        size = value;
+        assert(size + fixed_left <= size_t(end - in));
+        return in;
+    }
+
+    template<class T>
+    struct field<std::vector<T>, typename std::enable_if<std::is_trivially_copyable<T>::value>::type>
+    {
+        constexpr static size_t fixed_size = sizeof(int);
+
+        static size_t variable_size(const std::vector<T> &value)
+        {
+            return value.size()*sizeof(T);
+        }
+
+        static unsigned char *write(unsigned char *out, const std::vector<T> &value)
+        {
+            const int size = value.size()*sizeof(T);
+            memcpy(out, &size, sizeof(size));
+            out += sizeof(size);
+            if (size > 0)
+                memcpy(out, &value[0], size);
+            return out + size;
+        }
+
+        static const unsigned char *read(const unsigned char *in, const unsigned char *end,
+                                         size_t fixed_left, std::vector<T> &value)
+        {
+            size_t size;
+            in = read_payload_size(in, end, fixed_left, size);
+            assert(size % sizeof(T) == 0);
+            value.resize(size / sizeof(T));
+            if (size > 0)
+                memcpy(&value[0], in, size);
+            return in + size;
+        }
+    };
+
+    template<>
+    struct field<std::string>
+    {
+        constexpr static size_t fixed_size = sizeof(int);
+
+        static size_t variable_size(const std::string &value)
+        {
+            return value.size();
+        }
+
+        static unsigned char *write(unsigned char *out, const std::string &value)
+        {
+            const int size = value.size();
+            memcpy(out, &size, sizeof(size));
+            out += sizeof(size);
+            memcpy(out, value.data(), size);
+            return out + size;
+        }
+
+        static const unsigned char *read(const unsigned char *in, const unsigned char *end,
+                                         size_t fixed_left, std::string &value)
+        {
+            size_t size;
+            in = read_payload_size(in, end, fixed_left, size);
+            value.assign(reinterpret_cast<const char *>(in), size);
+            return in + size;
+        }
+    };
+
+    // views point into buffer, nothing is allocated during deserialization
+    template<>
+    struct field<string_ref>
+    {
+        constexpr static size_t fixed_size = sizeof(int);
+
+        static size_t variable_size(const string_ref &value)
+        {
+            return value.size();
+        }
+
+        static unsigned char *write(unsigned char *out, const string_ref &value)
+        {
+            const int size = value.size();
+            memcpy(out, &size, sizeof(size));
+            out += sizeof(size);
+            if (size > 0)
+                memcpy(out, value.data(), size);
+            return out + size;
+        }
+
+        static const unsigned char *read(const unsigned char *in, const unsigned char *end,
+                                         size_t fixed_left, string_ref &value)
+        {
+            size_t size;
+            in = read_payload_size(in, end, fixed_left, size);
+            value = string_ref{reinterpret_cast<const char *>(in), size};
+            return in + size;
+        }
+    };
+
+    template<class T>
+    struct field<array_view<T>>
+    {
+        constexpr static size_t fixed_size = sizeof(int);
+
+        static size_t variable_size(const array_view<T> &value)
+        {
+            return value.size()*sizeof(T);
+        }
+
+        static unsigned char *write(unsigned char *out, const array_view<T> &value)
+        {
+            const int size = value.size()*sizeof(T);
+            memcpy(out, &size, sizeof(size));
+            out += sizeof(size);
+            if (size > 0)
+                memcpy(out, value.bytes, size);
+            return out + size;
+        }
+
+        static const unsigned char *read(const unsigned char *in, const unsigned char *end,
+                                         size_t fixed_left, array_view<T> &value)
+        {
+            size_t size;
+            in = read_payload_size(in, end, fixed_left, size);
+            assert(size % sizeof(T) == 0);
+            value = array_view<T>{in, size / sizeof(T)};
+            return in + size;
+        }
+    };
+
+    template<class Tuple, size_t I>
+    using field_type = field<typename std::decay<typename std::tuple_element<I, Tuple>::type>::type>;
+
+    // fixed size of fields [I, N) of tuple
+    template<class Tuple, size_t I = 0, size_t N = std::tuple_size<Tuple>::value>
+    struct fixed_size
+    {
+        constexpr static size_t value = field_type<Tuple, I>::fixed_size + fixed_size<Tuple, I + 1, N>::value;
+    };
+
+    template<class Tuple, size_t N>
+    struct fixed_size<Tuple, N, N>
+    {
+        constexpr static size_t value = 0;
+    };
+
+    template<class Tuple, size_t... I>
+    size_t variable_size(const Tuple &fields, std::index_sequence<I...>)
+    {
+        const size_t sizes[] = {0, field_type<Tuple, I>::variable_size(std::get<I>(fields))...};
+        size_t result = 0;
+        for (size_t size : sizes)
+            result += size;
+        return result;
+    }
+
+    template<class Tuple, size_t... I>
+    unsigned char *write(unsigned char *out, const Tuple &fields, std::index_sequence<I...>)
+    {
+        const int expand[] = {0, (out = field_type<Tuple, I>::write(out, std::get<I>(fields)), 0)...};
+        (void)expand;
+        return out;
+    }
+
+    template<class Tuple, size_t... I>
+    const unsigned char *read(const unsigned char *in, const unsigned char *end, Tuple &fields,
+                              std::index_sequence<I...>)
+    {
+        // braced list guarantees left to right order
+        const int expand[] = {0, (in = field_type<Tuple, I>::read(in, end, fixed_size<Tuple, I + 1>::value,
+                                                                     std::get<I>(fields)), 0)...};
+        (void)expand;
+        return in;
+    }
+
+    template<class Msg>
+    using fields_type = decltype(std::declval<Msg&>().fields());
+}
+
+// fields() returns tuple of references, serialize only reads through them
+template<class Msg>
+void serialize(byte_buffer &buffer, const Msg &msg)
+{
+    using tuple = detail::fields_type<Msg>;
+    constexpr size_t fields_number = std::tuple_size<tuple>::value;
+    const tuple fields = const_cast<Msg &>(msg).fields();
+
+    const size_t size = detail::fixed_size<tuple>::value +
+            detail::variable_size(fields, std::make_index_sequence<fields_number>());
+    buffer.reserve(size);
+    unsigned char *end = detail::write(&buffer.m_byte_buffer[buffer.offset], fields,
+                                       std::make_index_sequence<fields_number>());
+    assert(end == &buffer.m_byte_buffer[buffer.offset] + size);
+    (void)end;
+    buffer.offset += size;
+}
+
+template<class Msg>
+void deserialize(byte_buffer &buffer, Msg &msg)
+{
+    using tuple = detail::fields_type<Msg>;
+    constexpr size_t fields_number = std::tuple_size<tuple>::value;
+    tuple fields = msg.fields();
+
+    const unsigned char *begin = &buffer.m_byte_buffer[0];
+    const unsigned char *end = begin + buffer.capacity;
+    assert(buffer.offset + detail::fixed_size<tuple>::value <= size_t(buffer.capacity));
+    const unsigned char *in = detail::read(begin + buffer.offset, end, fields,
+                                           std::make_index_sequence<fields_number>());
+    buffer.offset = in - begin;
+}
+
+namespace detail
+{
+    template<class Msg>
+    auto deserialize_message(byte_buffer &buffer, Msg &msg, int) -> decltype(msg.fields(), void())
+    {
+        deserialize(buffer, msg);
+    }
+
+    template<class Msg>
+    auto deserialize_message(byte_buffer &buffer, Msg &msg, long) -> decltype(msg.deserialize_from_buffer(buffer), void())
+    {
+        msg.deserialize_from_buffer(buffer);
+    }
+}
+
+// field list is used if message has one, hand written deserialize_from_buffer otherwise
+template<class Msg>
+void deserialize_message(byte_buffer &buffer, Msg &msg)
+{
+    detail::deserialize_message(buffer, msg, 0);
+}
+
+}
+
+#endif // MESSAGE_FIELDS_HPP
@@ -1,12 +1,23 @@
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 
 #include <array>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <boost/process.hpp>
 #include <functional>
 #include "../custom_transport/logger.hpp"
+#include "../custom_transport/custom_transport.hpp"
+#include "../custom_transport/memory_pool.hpp"
+#include "../custom_transport/cached_clock.hpp"
+#include "../custom_transport/timer_wheel.hpp"
+#include "../epoll_server/message_dispatcher.hpp"
+#include <algorithm>
+#include <fstream>
+#include <thread>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
 #include <cstring>
 
 /*
@@ -701,9 +712,1157 @@ void stress_test__2k_clients_increased_size_requests()
 }
 
 
+/*
+ * In-process echo server (custom_transport linked into ./tests) so counters of transport can be
+   checked after conversation. Connection is registered in epoll once on accept so request/response
+   round trip shouldn't cost any epoll_ctl call.
+ */
+namespace in_process_echo
+{
+    void read_handler(int bytes_transferred, connection_data *connection)
+    {
+        if (bytes_transferred > 0)
+            async_write(connection);
+    }
+
+    void write_handler(int bytes_transferred, connection_data *connection)
+    {
+        if (bytes_transferred >= 0)
+            async_read(connection);
+    }
+
+    void accept_handler(int error, connection_data *connection)
+    {
+        assert(error == 0);
+        connection->write_handler = write_handler;
+        async_read(read_handler, connection);
+    }
+
+    std::thread start(t_accept_handler accept_handler, const transport_options &options = transport_options())
+    {
+        std::thread server([accept_handler, options](){
+            async_accept(accept_handler);
+            init(5556, options);
+            run();
+        });
+        sleep(1);
+        return server;
+    }
+}
+
+void stress_test__epoll_ctl_per_message()
+{
+    logger_.log("stress_test__epoll_ctl_per_message is starting");
+    constexpr static int clients_number = 10;
+    constexpr static int requests_number = 2000;
+
+    std::thread server = in_process_echo::start(in_process_echo::accept_handler);
+
+    {
+        std::vector<std::unique_ptr<synchronous_client>> clients;
+        for (int i = 0; i < clients_number; i++)
+            clients.emplace_back(new synchronous_client("127.0.0.1", "5556"));
+
+        for (int i = 0; i < requests_number; i++)
+            for (auto &client : clients)
+            {
+                const std::string request = std::to_string(i);
+                client->send(request);
+                assert(client->read(request.size()) == request);
+            }
+    }
+
+    stop();
+    server.join();
+    // late stop (after run returned) is ignored, so next server in this process runs normally
+    stop();
+
+    const transport_stats stats = get_stats();
+    logger_.log("epoll_ctl calls per message = %f (%zu calls, %zu messages)",
+                double(stats.epoll_ctl_calls) / stats.messages, stats.epoll_ctl_calls, stats.messages);
+    assert(stats.messages >= clients_number * requests_number);
+    // every loop registers listener, wakeup_fd and post_fd, then exactly one EPOLL_CTL_ADD per accepted client
+    const int registrations_per_loop = 3;
+    assert(stats.epoll_ctl_calls <= size_t(registrations_per_loop * transport_options().loops_number +
+                                           clients_number));
+}
+
+// server queues many big responses at once, client starts reading them later
+void stress_test__queued_responses_for_slow_client()
+{
+    logger_.log("stress_test__queued_responses_for_slow_client is starting");
+    constexpr static int responses_number = 8;
+    const std::string response(1024*1024, '#');
+    static const std::string *shared_response = &response;
+
+    const auto accept_handler = [](int error, connection_data *connection)
+    {
+        assert(error == 0);
+        async_read([](int bytes_transferred, connection_data *connection){
+            if (bytes_transferred <= 0)
+                return;
+            for (int i = 0; i < responses_number; i++)
+                async_write(nullptr, connection, shared_response->data(), shared_response->size());
+        }, connection);
+    };
+
+    std::thread server = in_process_echo::start(accept_handler);
+    {
+        synchronous_client client("127.0.0.1", "5556");
+        client.send("go");
+        sleep(1);
+        for (int i = 0; i < responses_number; i++)
+            assert(client.read(response.size()) == response);
+    }
+    stop();
+    server.join();
+}
+
+// header and echoed body are queued separately and gathered by transport into one sendmsg
+void stress_test__header_and_body_responses()
+{
+    logger_.log("stress_test__header_and_body_responses is starting");
+
+    const auto accept_handler = [](int error, connection_data *connection)
+    {
+        assert(error == 0);
+        connection->write_handler = [](int bytes_transferred, connection_data *connection){
+            if (bytes_transferred >= 0)
+                async_read(connection);
+        };
+        async_read([](int bytes_transferred, connection_data *connection){
+            if (bytes_transferred <= 0)
+                return;
+            const uint32_t header = bytes_transferred;
+            queue_write(connection, reinterpret_cast<const char*>(&header), sizeof(header));
+            async_write(connection);
+        }, connection);
+    };
+
+    std::thread server = in_process_echo::start(accept_handler);
+    {
+        synchronous_client client("127.0.0.1", "5556");
+        for (int i = 0; i < 10000; i++)
+        {
+            const std::string request = "request " + std::to_string(i);
+            client.send(request);
+            const std::string response = client.read(sizeof(uint32_t) + request.size());
+            uint32_t header = 0;
+            memcpy(&header, response.data(), sizeof(header));
+            assert(header == request.size());
+            assert(response.compare(sizeof(header), std::string::npos, request) == 0);
+        }
+    }
+    stop();
+    server.join();
+}
+
+// server reads into segments and asks for contiguous copy only to echo it back
+void stress_test__segmented_reads_with_contiguous_view()
+{
+    logger_.log("stress_test__segmented_reads_with_contiguous_view is starting");
+
+    const auto accept_handler = [](int error, connection_data *connection)
+    {
+        assert(error == 0);
+        set_segmented_reads(connection, true);
+        async_read([](int bytes_transferred, connection_data *connection){
+            if (bytes_transferred <= 0)
+                return;
+            assert(connection->segments.size == size_t(bytes_transferred));
+            const char *bytes = contiguous_view(connection);
+            async_write([](int, connection_data *connection){
+                if (connection != NULL)
+                    async_read(connection);
+            }, connection, bytes, bytes_transferred);
+        }, connection);
+    };
+
+    std::thread server = in_process_echo::start(accept_handler);
+    {
+        synchronous_client client("127.0.0.1", "5556");
+        std::string request;
+        for (int i = 0; request.size() < 3*1024*1024; i++)
+            request += std::to_string(i);
+
+        client.send(request);
+        size_t recieved_bytes = 0;
+        while (recieved_bytes < request.size())
+        {
+            auto response = client.read();
+            assert(request.compare(recieved_bytes, response.size(), response) == 0);
+            recieved_bytes += response.size();
+        }
+    }
+    stop();
+    server.join();
+}
+
+// many varint framed requests in one send, split frames, every frame echoed with u32 prefix
+void stress_test__framed_requests(const transport_options &options = transport_options())
+{
+    logger_.log("stress_test__framed_requests is starting");
+    constexpr static int requests_number = 3000;
+
+    const auto accept_handler = [](int error, connection_data *connection)
+    {
+        assert(error == 0);
+        async_read_frames([](const char *frame, size_t size, connection_data *connection){
+            if (connection == NULL)
+                return;
+            char prefix[max_frame_prefix_size];
+            queue_write(connection, prefix, encode_frame_prefix(frame_prefix::u32, size, prefix));
+            async_write(nullptr, connection, frame, size);
+        }, connection, frame_prefix::varint, 1024*1024);
+    };
+
+    std::thread server = in_process_echo::start(accept_handler, options);
+    {
+        synchronous_client client("127.0.0.1", "5556");
+        std::string batch;
+        std::vector<std::string> requests;
+        for (int i = 0; i < requests_number; i++)
+        {
+            requests.push_back(std::string(i % 300, 'a' + i % 26) + std::to_string(i));
+            char prefix[max_frame_prefix_size];
+            batch.append(prefix, encode_frame_prefix(frame_prefix::varint, requests.back().size(), prefix));
+            batch.append(requests.back());
+        }
+        // second half is sent in small pieces so frames are split between reads
+        const size_t half = batch.size() / 2;
+        client.send(batch.substr(0, half));
+        for (size_t i = half; i < batch.size(); i += 1000)
+            client.send(batch.substr(i, 1000));
+
+        for (auto &request : requests)
+        {
+            const std::string prefix = client.read(sizeof(uint32_t));
+            size_t size = 0;
+            assert(decode_frame_prefix(frame_prefix::u32, prefix.data(), prefix.size(), &size) == 4);
+            assert(size == request.size());
+            assert(client.read(size) == request);
+        }
+    }
+    stop();
+    server.join();
+}
+
+// frames sent right before end of stream are answered, then connection is closed
+void stress_test__framed_requests_before_end_of_stream()
+{
+    logger_.log("stress_test__framed_requests_before_end_of_stream is starting");
+    constexpr static int requests_number = 100;
+    static std::atomic<int> closed_notifications;
+
+    const auto accept_handler = [](int error, connection_data *connection)
+    {
+        assert(error == 0);
+        // frames and end of stream are already waiting when reading starts, so they come in one batch
+        const connection_id id = connection->id;
+        add_timer(200, 0, [id](){
+            async_read_frames([](const char *frame, size_t size, connection_data *connection){
+                if (connection == NULL)
+                {
+                    closed_notifications++;
+                    return;
+                }
+                char prefix[max_frame_prefix_size];
+                queue_write(connection, prefix, encode_frame_prefix(frame_prefix::u16, size, prefix));
+                queue_write(connection, frame, size);
+            }, find_connection(id), frame_prefix::u16, 1024);
+        });
+    };
+
+    for (io_backend backend : {io_backend::epoll, io_backend::io_uring})
+    {
+        transport_options options;
+        options.backend = backend;
+        closed_notifications = 0;
+        std::thread server = in_process_echo::start(accept_handler, options);
+        {
+            synchronous_client client("127.0.0.1", "5556");
+            std::string batch;
+            std::vector<std::string> requests;
+            for (int i = 0; i < requests_number; i++)
+            {
+                requests.push_back("request " + std::to_string(i));
+                char prefix[max_frame_prefix_size];
+                batch.append(prefix, encode_frame_prefix(frame_prefix::u16, requests.back().size(), prefix));
+                batch.append(requests.back());
+            }
+            client.send(batch);
+            client.socket.shutdown(tcp::socket::shutdown_send);
+
+            for (auto &request : requests)
+            {
+                const std::string prefix = client.read(sizeof(uint16_t));
+                size_t size = 0;
+                assert(decode_frame_prefix(frame_prefix::u16, prefix.data(), prefix.size(), &size) == 2);
+                assert(size == request.size());
+                assert(client.read(size) == request);
+            }
+            boost::system::error_code error;
+            char byte;
+            const size_t recieved_bytes = client.socket.read_some(boost::asio::buffer(&byte, 1), error);
+            assert(recieved_bytes == 0 && error == boost::asio::error::eof);
+        }
+        stop();
+        server.join();
+        assert(closed_notifications == 1);
+        assert(get_stats().messages == size_t(requests_number));
+    }
+}
+
+// the same echo on io_uring loops (or on epoll if kernel doesn't support it) - no epoll_ctl at all
+void stress_test__io_uring_backend()
+{
+    logger_.log("stress_test__io_uring_backend is starting");
+    constexpr static int clients_number = 10;
+    constexpr static int requests_number = 500;
+
+    transport_options options;
+    options.loops_number = 2;
+    options.backend = io_backend::io_uring;
+    std::thread server = in_process_echo::start(in_process_echo::accept_handler, options);
+    const bool uring = active_backend() == io_backend::io_uring;
+    {
+        std::vector<std::unique_ptr<synchronous_client>> clients;
+        for (int i = 0; i < clients_number; i++)
+            clients.emplace_back(new synchronous_client("127.0.0.1", "5556"));
+
+        for (int i = 0; i < requests_number; i++)
+            for (auto &client : clients)
+            {
+                const std::string request = std::to_string(i);
+                client->send(request);
+                assert(client->read(request.size()) == request);
+            }
+
+        std::string request;
+        for (int i = 0; request.size() < 3*1024*1024; i++)
+            request += std::to_string(i);
+        clients[0]->send(request);
+        size_t recieved_bytes = 0;
+        while (recieved_bytes < request.size())
+        {
+            auto response = clients[0]->read();
+            assert(request.compare(recieved_bytes, response.size(), response) == 0);
+            recieved_bytes += response.size();
+        }
+    }
+    sleep(1);
+    stop();
+    server.join();
+
+    const transport_stats stats = get_stats();
+    logger_.log("%s backend: %zu wakeups for %zu messages", uring? "io_uring" : "epoll",
+                stats.wakeups, stats.messages);
+    assert(stats.accepted == clients_number && stats.active_connections == 0);
+    assert(!uring || stats.epoll_ctl_calls == 0);
+
+    stress_test__framed_requests(options);
+}
+
+// counters of loop are consistent with what client sent and got back
+void stress_test__loop_stats()
+{
+    logger_.log("stress_test__loop_stats is starting");
+    constexpr static int requests_number = 1000;
+
+    std::thread server = in_process_echo::start(in_process_echo::accept_handler);
+    size_t sent_bytes = 0;
+    {
+        synchronous_client client("127.0.0.1", "5556");
+        for (int i = 0; i < requests_number; i++)
+        {
+            const std::string request = "request " + std::to_string(i);
+            client.send(request);
+            assert(client.read(request.size()) == request);
+            sent_bytes += request.size();
+        }
+
+        const transport_stats running = get_loop_stats(0);
+        assert(running.active_connections == 1 && running.accepted == 1);
+        assert(running.pool_bytes_in_use > 0);
+    }
+    sleep(1);
+    stop();
+    server.join();
+
+    const transport_stats stats = get_stats();
+    assert(stats.bytes_read == sent_bytes && stats.bytes_written == sent_bytes);
+    assert(stats.messages == requests_number);
+    assert(stats.read_calls >= requests_number && stats.write_calls >= requests_number);
+    assert(stats.wakeups > 0 && stats.events >= stats.wakeups);
+    assert(stats.active_connections == 0);
+}
+
+// pipelined frames from one send are answered by silent queue_write-s flushed in few sendmsg-s
+void stress_test__pipelined_framed_requests()
+{
+    logger_.log("stress_test__pipelined_framed_requests is starting");
+    constexpr static int requests_number = 1000;
+
+    const auto accept_handler = [](int error, connection_data *connection)
+    {
+        assert(error == 0);
+        async_read_frames([](const char *frame, size_t size, connection_data *connection){
+            if (connection == NULL)
+                return;
+            char prefix[max_frame_prefix_size];
+            queue_write(connection, prefix, encode_frame_prefix(frame_prefix::u8, size, prefix));
+            queue_write(connection, frame, size);
+        }, connection, frame_prefix::u8, 255);
+    };
+
+    std::thread server = in_process_echo::start(accept_handler);
+    {
+        synchronous_client client("127.0.0.1", "5556");
+        std::string batch;
+        std::vector<std::string> requests;
+        for (int i = 0; i < requests_number; i++)
+        {
+            requests.push_back("request " + std::to_string(i));
+            batch += char(requests.back().size());
+            batch += requests.back();
+        }
+        client.send(batch);
+
+        for (auto &request : requests)
+        {
+            const std::string prefix = client.read(1);
+            assert(size_t(uint8_t(prefix[0])) == request.size());
+            assert(client.read(request.size()) == request);
+        }
+    }
+    stop();
+    server.join();
+
+    const transport_stats stats = get_stats();
+    logger_.log("%zu write calls for %d pipelined requests", stats.write_calls, requests_number);
+    assert(stats.write_calls <= requests_number / 10);
+}
+
+// responses are built in place in outbound queue, buffer is grown while response is being written
+void stress_test__responses_built_in_place()
+{
+    logger_.log("stress_test__responses_built_in_place is starting");
+    constexpr static int requests_number = 200;
+
+    const auto accept_handler = [](int error, connection_data *connection)
+    {
+        assert(error == 0);
+        async_read_frames([](const char *frame, size_t size, connection_data *connection){
+            if (connection == NULL)
+                return;
+            // response = u32 prefix + frame repeated 3 times, every part reserved separately
+            ::buffer *data = prepare_write(connection, sizeof(uint32_t));
+            size_t written = encode_frame_prefix(frame_prefix::u32, 3 * size, data->bytes + data->size);
+            for (int i = 0; i < 3; i++)
+            {
+                data = prepare_write(connection, written + size);
+                memcpy(data->bytes + data->size + written, frame, size);
+                written += size;
+            }
+            commit_write(connection, written);
+        }, connection, frame_prefix::varint, 1024*1024);
+    };
+
+    std::thread server = in_process_echo::start(accept_handler);
+    {
+        synchronous_client client("127.0.0.1", "5556");
+        std::string batch;
+        std::vector<std::string> requests;
+        for (int i = 0; i < requests_number; i++)
+        {
+            requests.push_back(std::string((i * 997) % (64*1024), 'a' + i % 26) + std::to_string(i));
+            char prefix[max_frame_prefix_size];
+            batch.append(prefix, encode_frame_prefix(frame_prefix::varint, requests.back().size(), prefix));
+            batch.append(requests.back());
+        }
+        client.send(batch);
+
+        for (auto &request : requests)
+        {
+            const std::string prefix = client.read(sizeof(uint32_t));
+            size_t size = 0;
+            assert(decode_frame_prefix(frame_prefix::u32, prefix.data(), prefix.size(), &size) == 4);
+            assert(size == 3 * request.size());
+            assert(client.read(size) == request + request + request);
+        }
+    }
+    stop();
+    server.join();
+}
+
+struct player_state
+{
+    static int message_id() { return 3; }
+    int id;
+    long x, y;
+    char flags;
+    std::string name;
+    std::vector<int> items;
+    std::vector<double> position;
+    auto fields() { return std::tie(id, x, y, flags, name, items, position); }
+};
+
+// generated serialization gives the same bytes as hand written put_* and reads them back
+void serialization__field_list()
+{
+    logger_.log("serialization__field_list is starting");
+    const player_state state = {7, -1, 1L << 40, 'f', "player one", {1, 2, 3}, {0.5, -2.0}};
+
+    serialization::byte_buffer generated, hand_written;
+    serialization::serialize(generated, state);
+    hand_written.put_int(state.id);
+    hand_written.put_long(state.x);
+    hand_written.put_long(state.y);
+    hand_written.put_char(state.flags);
+    hand_written.put_string(state.name);
+    hand_written.put_int_vector(state.items);
+    hand_written.put_double_vector(state.position);
+    assert(generated.get_size() == hand_written.get_size());
+    assert(memcmp(generated.m_byte_buffer, hand_written.m_byte_buffer, generated.get_size()) == 0);
+
+    serialization::byte_buffer view(generated.m_byte_buffer, generated.get_size());
+    player_state result = {};
+    serialization::deserialize(view, result);
+    assert(view.get_size() == generated.get_size());
+    assert(result.id == state.id && result.x == state.x && result.y == state.y);
+    assert(result.flags == state.flags && result.name == state.name);
+    assert(result.items == state.items && result.position == state.position);
+}
+
+template<int id>
+struct numbered_message
+{
+    static int message_id() { return id; }
+    int value;
+    auto fields() { return std::tie(value); }
+};
+
+// messages go straight to handler registered for their id, unknown id is dropped
+void message_dispatcher__table_lookup()
+{
+    logger_.log("message_dispatcher__table_lookup is starting");
+    static std::vector<int> handled;
+    handled.clear();
+
+    networking::message_dispatcher dispatcher;
+    dispatcher.add_handler([](numbered_message<1> msg){ handled.push_back(100 + msg.value); });
+    dispatcher.add_handler([](numbered_message<200> msg){ handled.push_back(200 + msg.value); });
+    dispatcher.add_handler([](numbered_message<7> msg){ handled.push_back(700 + msg.value); });
+
+    for (int id : {200, 1, 42, 7})
+    {
+        serialization::byte_buffer buffer;
+        buffer.put_value<unsigned char>(id);
+        buffer.put_int(id % 10);
+        serialization::byte_buffer view(buffer.m_byte_buffer, buffer.get_size());
+        dispatcher.dispatch_msg_from_buffer(view);
+    }
+    assert((handled == std::vector<int>{200, 101, 707}));
+}
+
+struct player_state_view
+{
+    static int message_id() { return 3; }
+    int id;
+    long x, y;
+    char flags;
+    serialization::string_ref name;
+    serialization::array_view<int> items;
+    serialization::array_view<double> position;
+    auto fields() { return std::tie(id, x, y, flags, name, items, position); }
+};
+
+// view version of message is decoded from the same bytes and points into receive buffer
+void message_dispatcher__views_point_into_buffer()
+{
+    logger_.log("message_dispatcher__views_point_into_buffer is starting");
+    static const unsigned char *begin, *end;
+    static bool handled;
+    handled = false;
+
+    player_state state = {7, -1, 1L << 40, 'f', "player one", {1, 2, 3}, {0.5, -2.0}};
+    serialization::byte_buffer buffer;
+    buffer.put_value<unsigned char>(player_state::message_id());
+    serialization::serialize(buffer, state);
+    // odd offset, so payloads aren't aligned
+    std::vector<unsigned char> received(buffer.get_size() + 1);
+    memcpy(&received[1], buffer.m_byte_buffer, buffer.get_size());
+    begin = &received[1];
+    end = begin + buffer.get_size();
+
+    networking::message_dispatcher dispatcher;
+    dispatcher.add_handler([](const player_state_view &msg){
+        assert(msg.id == 7 && msg.x == -1 && msg.y == 1L << 40 && msg.flags == 'f');
+        assert(msg.name == "player one");
+        assert(msg.items.size() == 3 && msg.items[2] == 3);
+        assert((msg.position.to_vector() == std::vector<double>{0.5, -2.0}));
+        int sum = 0;
+        for (int item : msg.items)
+            sum += item;
+        assert(sum == 6);
+        const unsigned char *name = reinterpret_cast<const unsigned char *>(msg.name.data());
+        assert(name >= begin && name < end && msg.items.bytes > name && msg.position.bytes < end);
+        handled = true;
+    });
+
+    serialization::byte_buffer view(begin, buffer.get_size());
+    dispatcher.dispatch_msg_from_buffer(view);
+    assert(handled);
+}
+
+// lines recorded by many threads in async mode are all in log file after writer is stopped
+void logger__async_lines_from_many_threads()
+{
+    logger_.log("logger__async_lines_from_many_threads is starting");
+    constexpr static int threads_number = 4;
+    constexpr static int lines_number = 1000;
+
+    logger_.set_async(true);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threads_number; i++)
+        threads.emplace_back([i](){
+            const std::string name = "thread " + std::to_string(i);
+            for (int line = 0; line < lines_number; line++)
+            {
+                logger_.log("async line %d from %s", line, name.c_str());
+                if (line % 100 == 0)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            }
+        });
+    for (auto &thread : threads)
+        thread.join();
+    // NULL string is printed like synchronous mode does it
+    const char *no_name = nullptr;
+    logger_.log("async line without name: %s", no_name);
+
+    // writer which went to sleep is woken up by next line
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    logger_.log("async line after idle period");
+    bool woken_up = false;
+    for (int i = 0; i < 100 && !woken_up; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::ifstream file("log.txt");
+        std::string line;
+        while (std::getline(file, line) && !woken_up)
+            woken_up = line.find("async line after idle period") != std::string::npos;
+    }
+    assert(woken_up);
+    logger_.set_async(false);
+
+    std::ifstream file("log.txt");
+    std::string line;
+    int found = 0;
+    bool null_found = false;
+    std::vector<int> next_line(threads_number, 0);
+    while (std::getline(file, line))
+    {
+        null_found |= line.find("async line without name: (null)") != std::string::npos;
+        int number = 0, thread = 0;
+        const size_t position = line.find("async line ");
+        if (position == std::string::npos ||
+                sscanf(line.c_str() + position, "async line %d from thread %d", &number, &thread) != 2)
+            continue;
+        // lines of one thread keep order
+        assert(number == next_line[thread]);
+        next_line[thread]++;
+        found++;
+    }
+    assert(found == threads_number * lines_number);
+    assert(null_found);
+}
+
+// arguments of disabled level aren't even evaluated
+void logger__runtime_level()
+{
+    logger_.log("logger__runtime_level is starting");
+    int evaluated = 0;
+    logger_.set_level(LOG_LEVEL_WARN);
+    LOG_DEBUG("debug line %d", ++evaluated);
+    LOG_INFO("info line %d", ++evaluated);
+    assert(evaluated == 0);
+    LOG_ERROR("error line %d", ++evaluated);
+    assert(evaluated == 1);
+    logger_.set_level(LOG_LEVEL_TRACE);
+}
+
+// clock driven by loop changes only on update, free thread gets fresh time on every read
+void cached_clock__driven_by_loop()
+{
+    logger_.log("cached_clock__driven_by_loop is starting");
+    std::thread loop([](){
+        update_cached_clock();
+        const uint64_t start = cached_clock().monotonic_ms;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        assert(cached_clock().monotonic_ms == start);
+        update_cached_clock();
+        assert(cached_clock().monotonic_ms >= start + 20);
+
+        release_cached_clock();
+        const uint64_t released = cached_clock().monotonic_ms;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        assert(cached_clock().monotonic_ms >= released + 20);
+        assert(strlen(cached_clock().prefix) == 8);
+    });
+    loop.join();
+}
+
+// blocks allocated by this thread are released by worker and come back to owner's free lists
+void memory_pool__cross_thread_free()
+{
+    logger_.log("memory_pool__cross_thread_free is starting");
+    constexpr static int blocks_number = 1000;
+    memory_pool *pool = thread_pool();
+
+    std::vector<std::pair<void*, size_t>> blocks;
+    for (int i = 0; i < blocks_number; i++)
+    {
+        const size_t size = (i % 2 == 0)? 100 : 5000;
+        blocks.emplace_back(allocate(pool, size), size);
+    }
+
+    std::thread worker([&blocks](){
+        for (auto &block : blocks)
+            deallocate(block.first, block.second);
+    });
+    worker.join();
+
+    collect_remote_frees(pool);
+    void *small = allocate(pool, 100);
+    assert(std::find_if(blocks.begin(), blocks.end(), [small](auto &block){
+        return block.first == small; }) != blocks.end());
+    deallocate(small, 100);
+}
+
+// timers of all levels fire in their tick (never before), re-armed and cancelled ones are respected
+void timer_wheel__expiry_and_cascade()
+{
+    logger_.log("timer_wheel__expiry_and_cascade is starting");
+    constexpr static int timers_number = 2000;
+
+    static uint64_t previous, now;
+    static int fired;
+    timer_wheel *wheel = new timer_wheel;
+    init_timer_wheel(wheel, 1000);
+    now = 1000;
+    fired = 0;
+
+    std::vector<timer_node> timers(timers_number);
+    for (int i = 0; i < timers_number; i++)
+    {
+        timers[i] = timer_node {};
+        timers[i].owner = &timers[i];
+        timers[i].expire = [](timer_node *timer){
+            assert(timer->expires > previous && timer->expires <= now);
+            fired++;
+        };
+        // from few ms up to few hours, so all levels are used
+        const uint64_t delay = 1 + (uint64_t(i) * i * 7919) % (uint64_t(1) << (4 + i % 20));
+        schedule_timer(wheel, &timers[i], now + delay);
+    }
+    // every third timer is moved, every fifth one cancelled
+    int expected = timers_number;
+    for (int i = 0; i < timers_number; i += 3)
+        schedule_timer(wheel, &timers[i], now + 500 + i);
+    for (int i = 0; i < timers_number; i += 5, expected--)
+        unschedule_timer(wheel, &timers[i]);
+
+    while (fired < expected)
+    {
+        const int timeout = next_timer_timeout(wheel);
+        assert(timeout > 0);
+        // loop wakes up exactly at deadline or somewhat late
+        previous = now;
+        now += (fired % 2 == 0)? timeout : timeout + 37;
+        advance_timer_wheel(wheel, now);
+    }
+    assert(next_timer_timeout(wheel) == -1);
+    for (auto &timer : timers)
+        assert(!timer_armed(&timer));
+    delete wheel;
+}
+
+// idle connection is closed by loop, periodic timer sends heartbeats until it cancels itself
+void stress_test__timeouts_and_heartbeat()
+{
+    logger_.log("stress_test__timeouts_and_heartbeat is starting");
+    constexpr static int idle_timeout = 300;
+    static loop_timer *heartbeat;
+    static int heartbeats;
+
+    const auto accept_handler = [](int error, connection_data *connection)
+    {
+        assert(error == 0);
+        // client never sends, so connection is idle except of heartbeats
+        async_read([](int, connection_data *){}, connection);
+        heartbeats = 0;
+        const connection_id id = connection->id;
+        heartbeat = add_timer(50, 50, [id](){
+            connection_data *connection = find_connection(id);
+            assert(connection != NULL);
+            queue_write(connection, "tick", 4);
+            if (++heartbeats == 3)
+                cancel_timer(heartbeat);
+        });
+    };
+
+    for (io_backend backend : {io_backend::epoll, io_backend::io_uring})
+    {
+        transport_options options;
+        options.idle_timeout_ms = idle_timeout;
+        options.backend = backend;
+        std::thread server = in_process_echo::start(accept_handler, options);
+        {
+            synchronous_client client("127.0.0.1", "5556");
+            assert(client.read(12) == "tickticktick");
+            const auto idle_since = std::chrono::steady_clock::now();
+
+            boost::system::error_code error;
+            char byte;
+            const size_t recieved_bytes = client.socket.read_some(boost::asio::buffer(&byte, 1), error);
+            const auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - idle_since).count();
+            logger_.log("idle connection was closed after %ld ms", long(idle));
+            assert(recieved_bytes == 0 && error == boost::asio::error::eof);
+            assert(idle >= idle_timeout - 50 && idle < 5*idle_timeout);
+        }
+        stop();
+        server.join();
+        assert(get_stats().active_connections == 0);
+    }
+}
+
+// server which doesn't read keeps bounded memory, sender is stopped by TCP window until server drains
+void stress_test__read_watermarks()
+{
+    logger_.log("stress_test__read_watermarks is starting");
+    constexpr static size_t stream_size = 32*1024*1024;
+    constexpr static size_t chunk_size = 64*1024;
+    constexpr static size_t high_watermark = 64*1024;
+    static std::atomic<size_t> sent;
+    static size_t received;
+
+    const auto read_handler = [](int bytes_transferred, connection_data *connection)
+    {
+        assert(bytes_transferred > 0 && size_t(bytes_transferred) <= high_watermark);
+        received += bytes_transferred;
+        if (received < stream_size)
+            async_read(connection);
+        else
+            async_write(nullptr, connection, "done", 4);
+    };
+
+    const auto accept_handler = [read_handler](int error, connection_data *connection)
+    {
+        assert(error == 0);
+        received = 0;
+        connection->read_handler = read_handler;
+        // application is busy for a while, nobody reads
+        const connection_id id = connection->id;
+        add_timer(500, 0, [id](){
+            const transport_stats stats = get_loop_stats(0);
+            logger_.log("before first read: %zu B sent, %zu B in pool, %zu read pauses",
+                        sent.load(), stats.pool_bytes_in_use, stats.read_pauses);
+            assert(sent.load() < stream_size);
+            // io_uring may complete receives already in flight (up to all provided buffers) after pause
+            assert(stats.pool_bytes_in_use < high_watermark + URINGBUFFERS*URINGBUFFERLEN + 1024*1024);
+            async_read(find_connection(id));
+        });
+    };
+
+    for (io_backend backend : {io_backend::epoll, io_backend::io_uring})
+    {
+        transport_options options;
+        options.backend = backend;
+        options.read_high_watermark = high_watermark;
+        options.read_low_watermark = high_watermark / 4;
+        std::thread server = in_process_echo::start(accept_handler, options);
+        {
+            synchronous_client client("127.0.0.1", "5556");
+            sent = 0;
+            std::thread sender([&client](){
+                const std::string chunk(chunk_size, 'x');
+                while (sent < stream_size)
+                {
+                    client.send(chunk);
+                    sent += chunk_size;
+                }
+            });
+            sender.join();
+            assert(client.read(4) == "done");
+        }
+        stop();
+        server.join();
+        const transport_stats stats = get_stats();
+        assert(stats.bytes_read == stream_size && stats.read_pauses > 0);
+    }
+}
+
+// interactive client keeps getting answers while other one streams as fast as it can
+void stress_test__fair_budgets()
+{
+    logger_.log("stress_test__fair_budgets is starting");
+    constexpr static size_t stream_size = 128*1024*1024;
+    constexpr static size_t chunk_size = 1024*1024;
+    constexpr static size_t budget = 64*1024;
+    constexpr static int requests_number = 200;
+    static size_t streamed;
+
+    const auto read_handler = [](int bytes_transferred, connection_data *connection)
+    {
+        if (bytes_transferred <= 0)
+            return;
+        assert(size_t(bytes_transferred) <= budget);
+        if (connection->data.bytes[0] == 'p')
+        {
+            async_write(connection);
+            return;
+        }
+
+        streamed += bytes_transferred;
+        if (streamed == stream_size)
+            async_write(nullptr, connection, "done", 4);
+        async_read(connection);
+    };
+
+    const auto accept_handler = [read_handler](int error, connection_data *connection)
+    {
+        assert(error == 0);
+        connection->write_handler = in_process_echo::write_handler;
+        async_read(read_handler, connection);
+    };
+
+    for (io_backend backend : {io_backend::epoll, io_backend::io_uring})
+    {
+        transport_options options;
+        options.backend = backend;
+        options.round_budget_bytes = budget;
+        streamed = 0;
+        std::thread server = in_process_echo::start(accept_handler, options);
+        {
+            synchronous_client bulk("127.0.0.1", "5556");
+            synchronous_client interactive("127.0.0.1", "5556");
+            std::atomic<bool> streaming {true};
+            std::thread sender([&bulk, &streaming](){
+                const std::string chunk(chunk_size, 'x');
+                for (size_t sent = 0; sent < stream_size; sent += chunk_size)
+                    bulk.send(chunk);
+                assert(bulk.read(4) == "done");
+                streaming = false;
+            });
+
+            long max_latency = 0;
+            int during_stream = 0;
+            for (int i = 0; i < requests_number; i++)
+            {
+                const std::string request = "ping " + std::to_string(1000000 + i);
+                const auto start = std::chrono::steady_clock::now();
+                interactive.send(request);
+                assert(interactive.read(request.size()) == request);
+                const long latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start).count();
+                max_latency = std::max(max_latency, latency);
+                during_stream += streaming? 1 : 0;
+            }
+            sender.join();
+            logger_.log("%d of %d requests during stream, max latency %ld us", during_stream,
+                        requests_number, max_latency);
+            assert(max_latency < 1000000);
+        }
+        stop();
+        server.join();
+        const transport_stats stats = get_stats();
+        logger_.log("budget was used up %zu times", stats.budget_exhausted);
+        assert(stats.budget_exhausted > 0);
+    }
+}
+
+// producers post to loop without locks, replies computed on other threads are sent by connection id
+void stress_test__cross_thread_post()
+{
+    logger_.log("stress_test__cross_thread_post is starting");
+    constexpr static int producers_number = 4;
+    constexpr static int tasks_number = 20000;
+    constexpr static int requests_number = 200;
+    static int last_task[producers_number];
+    static std::atomic<int> tasks_done;
+
+    const auto read_handler = [](int bytes_transferred, connection_data *connection)
+    {
+        if (bytes_transferred <= 0)
+            return;
+        const connection_id id = connection->id;
+        if (connection->data.bytes[0] == 'j')
+        {
+            // response is built in worker's own pool, worker exits (with its pool) before loop takes task
+            const std::string request(connection->data.bytes, connection->data.size);
+            std::thread([id, request](){
+                ::buffer response {request.size(), 0, request.size(), nullptr};
+                response.bytes = (char *) allocate(thread_pool(), response.capacity);
+                std::transform(request.begin(), request.end(), response.bytes, ::toupper);
+                send(id, &response);
+            }).join();
+            async_read(connection);
+            return;
+        }
+        // response is computed by worker thread which has only connection id
+        ::buffer request = detach_buffer(connection);
+        std::thread([id, request]() mutable {
+            for (size_t i = request.start; i < request.size; i++)
+                request.bytes[i] = toupper(request.bytes[i]);
+            send(id, &request);
+        }).detach();
+        async_read(connection);
+    };
+
+    const auto accept_handler = [read_handler](int error, connection_data *connection)
+    {
+        assert(error == 0);
+        async_read(read_handler, connection);
+    };
+
+    for (io_backend backend : {io_backend::epoll, io_backend::io_uring})
+    {
+        transport_options options;
+        options.backend = backend;
+        std::fill(last_task, last_task + producers_number, -1);
+        tasks_done = 0;
+        std::thread server = in_process_echo::start(accept_handler, options);
+
+        std::vector<std::thread> producers;
+        for (int producer = 0; producer < producers_number; producer++)
+            producers.emplace_back([producer](){
+                for (int i = 0; i < tasks_number; i++)
+                    post(0, [producer, i](){
+                        // runs on loop thread, so plain ints are enough; order per producer is kept
+                        assert(last_task[producer] == i - 1);
+                        last_task[producer] = i;
+                        tasks_done++;
+                    });
+            });
+        for (auto &producer : producers)
+            producer.join();
+
+        {
+            synchronous_client client("127.0.0.1", "5556");
+            for (int i = 0; i < requests_number; i++)
+            {
+                const std::string request = ((i % 2)? "joined " : "request ") + std::to_string(i);
+                std::string response = request;
+                std::transform(response.begin(), response.end(), response.begin(), ::toupper);
+                client.send(request);
+                assert(client.read(response.size()) == response);
+            }
+        }
+        assert(tasks_done == producers_number * tasks_number);
+        stop();
+        server.join();
+
+        const transport_stats stats = get_stats();
+        logger_.log("%zu posted tasks, %zu wakeups", stats.posted_tasks, stats.post_wakeups);
+        assert(stats.posted_tasks == size_t(producers_number * tasks_number + requests_number));
+        assert(stats.post_wakeups < stats.posted_tasks);
+    }
+}
+
+// listener which hit EMFILE accepts pending client as soon as some connection is closed
+void stress_test__accept_after_fd_exhaustion()
+{
+    logger_.log("stress_test__accept_after_fd_exhaustion is starting");
+    static std::atomic<int> accept_errors;
+
+    const auto accept_handler = [](int error, connection_data *connection)
+    {
+        if (error != 0)
+        {
+            accept_errors++;
+            return;
+        }
+        in_process_echo::accept_handler(error, connection);
+    };
+
+    for (io_backend backend : {io_backend::epoll, io_backend::io_uring})
+    {
+        transport_options options;
+        options.backend = backend;
+        accept_errors = 0;
+        // io_uring takes limit when accept is armed, so it's lowered before server starts
+        rlimit old_limit;
+        getrlimit(RLIMIT_NOFILE, &old_limit);
+        rlimit limit = old_limit;
+        limit.rlim_cur = std::min<rlim_t>(old_limit.rlim_cur, 4096);
+        setrlimit(RLIMIT_NOFILE, &limit);
+        std::thread server = in_process_echo::start(accept_handler, options);
+        {
+            synchronous_client first("127.0.0.1", "5556");
+            first.send("first");
+            assert(first.read(5) == "first");
+
+            // no descriptor is left for server when second client is waiting in backlog
+            std::vector<int> fillers;
+            for (int fd; (fd = open("/dev/null", O_RDONLY)) >= 0; )
+                fillers.push_back(fd);
+            assert(errno == EMFILE && !fillers.empty());
+            close(fillers.back());
+            fillers.pop_back();
+
+            int second = socket(AF_INET, SOCK_STREAM, 0);
+            assert(second >= 0);
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(5556);
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            int return_code = connect(second, (sockaddr *)&address, sizeof(address));
+            assert(return_code == 0);
+            for (int i = 0; i < 500 && accept_errors == 0; i++)
+                usleep(10*1000);
+            assert(accept_errors > 0);
+
+            for (int fd : fillers)
+                close(fd);
+
+            // no new connection comes, so only close of first one can resume accepting
+            first.socket.close();
+            timeval timeout = {5, 0};
+            setsockopt(second, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            return_code = write(second, "second", 6);
+            assert(return_code == 6);
+            char response[6];
+            size_t received = 0;
+            while (received < sizeof(response))
+            {
+                const ssize_t n = read(second, response + received, sizeof(response) - received);
+                assert(n > 0);
+                received += n;
+            }
+            assert(memcmp(response, "second", 6) == 0);
+            close(second);
+        }
+        stop();
+        server.join();
+        setrlimit(RLIMIT_NOFILE, &old_limit);
+        const transport_stats stats = get_stats();
+        logger_.log("%d accept errors, %zu accepted", accept_errors.load(), stats.accepted);
+        assert(stats.accepted == 2);
+    }
+}
 
 void tests()
 {
+    memory_pool__cross_thread_free();
+    timer_wheel__expiry_and_cascade();
+    logger__async_lines_from_many_threads();
+    logger__runtime_level();
+    cached_clock__driven_by_loop();
+    serialization__field_list();
+    message_dispatcher__table_lookup();
+    message_dispatcher__views_point_into_buffer();
+
     auto server_process = execute(
                 run_exe("../echo_server/echo_server"),
                 set_cmd_line("../echo_server/echo_server 5555")
@@ -719,9 +1878,23 @@ void tests()
     stress_test__increased_size_big_requests();
 
     stress_test__one_big_request_async();
-
-    // TO DO: only this shit fails
-    //stress_test__4k_clients();
+    stress_test__epoll_ctl_per_message();
+    stress_test__queued_responses_for_slow_client();
+    stress_test__header_and_body_responses();
+    stress_test__segmented_reads_with_contiguous_view();
+    stress_test__framed_requests();
+    stress_test__loop_stats();
+    stress_test__io_uring_backend();
+    stress_test__timeouts_and_heartbeat();
+    stress_test__read_watermarks();
+    stress_test__fair_budgets();
+    stress_test__cross_thread_post();
+    stress_test__accept_after_fd_exhaustion();
+    stress_test__pipelined_framed_requests();
+    stress_test__framed_requests_before_end_of_stream();
+    stress_test__responses_built_in_place();
+
+    stress_test__4k_clients();
 
     terminate(server_process);
 	logger_.log("All tests passed");